@@ -1,14 +1,17 @@
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
+#include "config.h"
+
 #include "8086/bios.h"
 #include "8086/cpu.h"
 #include "8086/mem.h"
 #include "vgui.h"
 #include "harddisk.h"
 #include "keyboard.h"
+#include "interupt.h"
 
-static void push_stack_reg(cpu8086_core_t* core, uint16_t reg);
 static void pop_stack_reg(cpu8086_core_t* core, uint16_t* reg);
 
 typedef void (*bios_ivt_func)(cpu8086_core_t*);
@@ -20,84 +23,153 @@ void bios_ivt_miscellaneoussystemservice(cpu8086_core_t*);
 void bios_ivt_keyboardservice(cpu8086_core_t*);
 void bios_ivt_parallelportservice(cpu8086_core_t*);
 void bios_ivt_clockservice(cpu8086_core_t*);
+void bios_ivt_harddiskirq(cpu8086_core_t*);
+void bios_ivt_harddiskirq2(cpu8086_core_t*);
 
 //bios中断，仅实现了常见的几种
 struct bios_ivt{
 	bios_ivt_func func;
 } bios_ivt_default[256] = {
-	NULL,	//0x00
-	NULL,	//0x01
-	NULL,	//0x02
-	NULL,	//0x03
-	NULL,	//0x04
-	NULL,	//0x05
-	NULL,	//0x06
-	NULL,	//0x07
-	NULL,	//0x08
-	NULL,	//0x09
-	NULL,	//0x0a
-	NULL,	//0x0b
-	NULL,	//0x0c
-	NULL,	//0x0d
-	NULL,	//0x0e
-	NULL,	//0x0f
-	bios_ivt_videoservice, //0x10, 显示服务
-	NULL,	//0x11
-	NULL,	//0x12
-	bios_ivt_directdiskservice, //0x13 直接磁盘服务
-	bios_ivt_serialportservice, //0x14 串口服务
-	bios_ivt_miscellaneoussystemservice, //0x15 杂项系统服务
-	bios_ivt_keyboardservice, 		//0x16 键盘服务
-	bios_ivt_parallelportservice, 	//0x17 并行口服务
-	NULL,							//0x18
-	NULL,							//0x19
-	bios_ivt_clockservice,			//0x1a 时钟服务
-	NULL,
+	[0x10] = {bios_ivt_videoservice},				//显示服务
+	[0x13] = {bios_ivt_directdiskservice},			//直接磁盘服务
+	[0x14] = {bios_ivt_serialportservice},			//串口服务
+	[0x15] = {bios_ivt_miscellaneoussystemservice},	//杂项系统服务
+	[0x16] = {bios_ivt_keyboardservice},			//键盘服务
+	[0x17] = {bios_ivt_parallelportservice},		//并行口服务
+	[0x1a] = {bios_ivt_clockservice},				//时钟服务
+	[0x76] = {bios_ivt_harddiskirq},				//IRQ14 硬盘中断
+	[0x77] = {bios_ivt_harddiskirq2},				//IRQ15 secondary通道硬盘中断
 };
 
-void bios_ivt_exec_8086(uint8_t n){
-	cpu8086_core_t* core = get_core();
+//8259A的硬件中断向量
+static int bios_ivt_is_irq(uint8_t n){
+	return (n >= 0x08 && n <= 0x0f) || (n >= 0x70 && n <= 0x77);
+}
+
+/*
+ * 生成bios映像: 每个中断向量一个陷阱入口, 以及0xffff0处的复位向量
+ */
+static void bios_rom_build(uint8_t* rom){
+	int n = 0;
+
+	memset(rom, 0, 65536);
+
+	for(; n < 256; n++){
+		uint8_t* stub = rom + BIOS_ROM_STUB_BASE + n * BIOS_ROM_STUB_SIZE;
+
+		stub[0] = BIOS_TRAP_OPCODE;
+		stub[1] = BIOS_TRAP_MARK;
+		stub[2] = (uint8_t)n;
+		stub[3] = 0xcf; //iret
+	}
+
+	//复位向量 jmp far 07c0:0000
+	rom[0xfff0] = 0xea;
+	rom[0xfff1] = 0x00;
+	rom[0xfff2] = 0x00;
+	rom[0xfff3] = 0xc0;
+	rom[0xfff4] = 0x07;
+
+	rom[0xfffe] = 0xfc; //机器型号 AT
+}
+
+/*
+ * 外部映像需要在与生成的映像相同的位置提供全部陷阱入口,
+ * 映像映射在bios区域的顶端, 至少要覆盖入口所在的8KiB
+ */
+static int bios_rom_check(const char* path){
+	int n = 0;
+
+	if(vm_rom_size() < 65536 - BIOS_ROM_STUB_BASE){
+		vm_fprintf(stderr, "bios rom %s does not cover the trap entries at %04x:%04x\n",
+				path, BIOS_ROM_SEGMENT, BIOS_ROM_STUB_BASE);
+		return -1;
+	}
+
+	for(; n < 256; n++){
+		addr_t addr = (addr_t)BIOS_ROM_SEGMENT * 16 + BIOS_ROM_STUB_BASE + n * BIOS_ROM_STUB_SIZE;
+
+		if(vm_read_byte(addr) != BIOS_TRAP_OPCODE || vm_read_byte(addr + 1) != BIOS_TRAP_MARK
+				|| vm_read_byte(addr + 2) != (uint8_t)n || vm_read_byte(addr + 3) != 0xcf){
+			vm_fprintf(stderr, "bios rom %s has no trap entry for interupt 0x%02x\n", path, n);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int bios_init_8086(const char* path){
+	int n = 0;
 
-	FLAGS_TF_SET(core, 0);
-	FLAGS_IF_SET(core, 0);
+	if(path){
+		if(vm_rom_map(path) < 0 || bios_rom_check(path) < 0){
+			return 0;
+		}
+	} else {
+		static uint8_t image[65536];
+
+		//内容相同时不写入, 避免公共内存映像中的bios页变为私有页
+		bios_rom_build(image);
+		if(memcmp(vm_rom(), image, sizeof(image)) != 0){
+			memcpy(vm_rom(), image, sizeof(image));
+		}
+
+		if(vm_rom_protect() < 0){
+			return 0;
+		}
+	}
+
+	//中断向量表指向映像中的陷阱入口, 外部映像已确认提供了这些入口
+	for(; n < 256; n++){
+		uint16_t offset = BIOS_ROM_STUB_BASE + n * BIOS_ROM_STUB_SIZE;
+
+		if(vm_read_word((addr_t)n * 4) != offset){
+			vm_write_word((addr_t)n * 4, offset);
+		}
+		if(vm_read_word((addr_t)n * 4 + 2) != BIOS_ROM_SEGMENT){
+			vm_write_word((addr_t)n * 4 + 2, BIOS_ROM_SEGMENT);
+		}
+	}
 
-	//压栈
-	push_stack_reg(core, core->reg.flags);
-	push_stack_reg(core, core->reg.cs);
-	push_stack_reg(core, core->reg.ip);
+	return 1;
+}
 
-	core->reg.cs = (uint16_t)n * 4 + 2;
-	core->reg.ip = (uint16_t)n * 4;
+/*
+ * 陷阱指令由guest的int指令或远调用进入, 返回时等同于retf 2:
+ * 恢复中断前的flags, 但保留服务设置的CF与ZF
+ * 没有设置服务的硬件中断只发送EOI
+ */
+void bios_ivt_trap_8086(uint8_t n){
+	cpu8086_core_t* core = get_core();
+	uint16_t flags = 0;
 
 	bios_ivt_func f = bios_ivt_default[n].func;
 	if(f){
 		f(core);
+	} else if(bios_ivt_is_irq(n)){
+		interupt_eoi(n >= 0x70 ? n - 0x70 + 8 : n - 0x08);
 	}
 
-	//出栈,本应该由iret指令负责，但是bios由软件实现，不在其中添加iret
-	//并且后续也不支持对中断的修改，所以出栈也不依靠iret
 	pop_stack_reg(core, &core->reg.ip);
 	pop_stack_reg(core, &core->reg.cs);
-	pop_stack_reg(core, &core->reg.flags);
-
-	FLAGS_TF_SET(core, 1);
-	FLAGS_IF_SET(core, 1);
-}
+	pop_stack_reg(core, &flags);
 
-static void push_stack_reg(cpu8086_core_t* core, uint16_t reg){
-	assert(core && reg);
-
-	addr_t addr = (addr_t)core->reg.ss * 16 + (addr_t)core->reg.sp;
-	vm_write_word(addr, reg);
-
-	core->reg.sp -= 2;
+	//硬件中断打断的是任意指令, 需要完整恢复flags
+	if(bios_ivt_is_irq(n)){
+		core->reg.flags = flags;
+	} else {
+		core->reg.flags = (flags & ~0x0041) | (core->reg.flags & 0x0041);
+	}
 }
 
+/*
+ * 与cpu的压栈相同, sp指向栈顶的字, 出栈先读取再移动sp
+ */
 static void pop_stack_reg(cpu8086_core_t* core, uint16_t* reg){
 	assert(core && reg);
 
-	addr_t addr = (addr_t)core->reg.ss * 16 + (addr_t)core->reg.sp;
-	*reg = vm_read_word(addr);
+	*reg = vm_read_word_seg(core->reg.ss, core->reg.sp);
 
 	core->reg.sp += 2;
 }
@@ -139,9 +211,8 @@ void bios_ivt_videoservice(cpu8086_core_t* core){
 		break;
 	case 0x07:  //初始化或滚屏  未实现
 		break;
-	case 0x08:  //读光标处的字符或属性
-		al = vgui_char();
-		core->reg.ax = (uint16_t)al;
+	case 0x08:  //读光标处的字符或属性, ah为属性, al为字符
+		core->reg.ax = vgui_char();
 
 		break;
 	case 0x09:  //在光标处按指定属性显示字符
@@ -150,7 +221,7 @@ void bios_ivt_videoservice(cpu8086_core_t* core){
 
 		i = 0;
 		for(; i < cx; i++){
-			vgui_set_char(al);
+			vgui_set_char(al, (uint8_t)core->reg.bx);	//bl为属性
 		}
 
 		break;
@@ -160,7 +231,7 @@ void bios_ivt_videoservice(cpu8086_core_t* core){
 
 		i = 0;
 		for(; i < cx; i++){
-			vgui_set_char(al);
+			vgui_set_char_only(al);
 		}
 
 		break;
@@ -193,6 +264,86 @@ void bios_ivt_videoservice(cpu8086_core_t* core){
 	}
 }
 
+/*
+ * 磁盘服务的返回状态, 失败时置CF并设置ah为0x04(扇区未找到), 成功时清CF和ah
+ */
+static void bios_disk_result(cpu8086_core_t* core, int rcode){
+	if(rcode < 0){
+		core->reg.flags |= 0x0001;
+		core->reg.ax = (core->reg.ax & 0x00ff) | 0x0400;
+	} else {
+		core->reg.flags &= ~0x0001;
+		core->reg.ax &= 0x00ff;
+	}
+}
+
+/*
+ * 扩展读写(42h/43h/44h/47h), ds:si指向磁盘地址包:
+ *     0x00  包大小(0x10)    0x01  保留
+ *     0x02  扇区数          0x04  缓冲区偏移:段
+ *     0x08  64位起始lba
+ * 一次调用的扇区数不受CHS的255个限制, 失败时包中的扇区数置0
+ */
+static int bios_disk_packet(cpu8086_core_t* core, uint8_t ah){
+	addr_t packet = vm_addr_calc(core->reg.ds, core->reg.si);
+	uint32_t count = vm_read_word(packet + 2);
+	addr_t addr = vm_addr_calc(vm_read_word(packet + 6), vm_read_word(packet + 4));
+	uint64_t lba = (uint64_t)vm_read_dword(packet + 8) | ((uint64_t)vm_read_dword(packet + 12) << 32);
+	uint8_t drive = (uint8_t)core->reg.dx;
+	uint64_t sectors = bios_harddisk_sectors(drive);
+	int ret = 0;
+
+	if(vm_read_byte(packet) < 0x10 || sectors == 0 || lba > sectors || count > sectors - lba){
+		ret = -1;
+	} else if(ah == 0x42){
+		ret = bios_harddisk_readsector(drive, addr, lba, count);
+	} else if(ah == 0x43){
+		ret = bios_harddisk_writesector(drive, addr, lba, count);
+	}
+
+	if(ret < 0){
+		vm_write_word(packet + 2, 0);
+	}
+
+	return ret;
+}
+
+//按小端序写入n字节
+static void bios_put_le(uint8_t* p, uint64_t v, int n){
+	int i = 0;
+
+	for(; i < n; i++){
+		p[i] = (uint8_t)(v >> (i * 8));
+	}
+}
+
+/*
+ * 读取扩展驱动器参数(48h), ds:si指向结果缓冲区, 缓冲区大小由调用者填入首字
+ */
+static int bios_disk_param(cpu8086_core_t* core){
+	addr_t buffer = vm_addr_calc(core->reg.ds, core->reg.si);
+	uint8_t drive = (uint8_t)core->reg.dx;
+	uint64_t sectors = bios_harddisk_sectors(drive);
+	uint8_t param[0x1a];
+
+	if(sectors == 0 || vm_read_word(buffer) < sizeof(param)){
+		return -1;
+	}
+
+	memset(param, 0, sizeof(param));
+	bios_put_le(param + 0x00, sizeof(param), 2);
+	bios_put_le(param + 0x02, 0x0002, 2);		//CHS参数有效
+	bios_put_le(param + 0x04, bios_harddisk_cylinders(drive), 4);
+	bios_put_le(param + 0x08, HDISK_H, 4);
+	bios_put_le(param + 0x0c, HDISK_S, 4);
+	bios_put_le(param + 0x10, sectors, 8);
+	bios_put_le(param + 0x18, VM_HDISK_SECTOR, 2);
+
+	vm_write(buffer, param, sizeof(param));
+
+	return 0;
+}
+
 void bios_ivt_directdiskservice(cpu8086_core_t* core){
 	uint8_t ah = (uint8_t)(core->reg.ax >> 8);
 	addr_t addr;
@@ -209,6 +360,7 @@ void bios_ivt_directdiskservice(cpu8086_core_t* core){
 	uint8_t h;
 	uint32_t H;
 	uint32_t S;
+	uint32_t c16;
 
 	switch(ah){
 	case 0x00:  // 磁盘系统复位
@@ -220,7 +372,7 @@ void bios_ivt_directdiskservice(cpu8086_core_t* core){
 		break;
 	case 0x01:  // 读取磁盘系统状态
 	case 0x10:  // 读取驱动器状态
-		status = bios_harddisk_status();
+		status = bios_harddisk_status((uint8_t)core->reg.dx);
 		err  = status & 0x01;
 		dreg = status & 0x08;
 		drdy = status & 0x40;
@@ -243,7 +395,7 @@ void bios_ivt_directdiskservice(cpu8086_core_t* core){
 		c = (uint8_t)(core->reg.cx >> 8); //柱面
 		s = (uint8_t)(core->reg.cx); 	  //扇区
 		h = (uint8_t)(core->reg.dx >> 8); //磁头
-		d = (uint8_t)(core->reg.dx);	  //驱动器, 无用
+		d = (uint8_t)(core->reg.dx);	  //驱动器
 		
 		H = HDISK_H; // 每磁柱磁头数
 		S = HDISK_S; // 每磁道扇区数
@@ -252,9 +404,7 @@ void bios_ivt_directdiskservice(cpu8086_core_t* core){
 		
 		addr = vm_addr_calc(core->reg.es, core->reg.bx);
 
-		bios_harddisk_readsector(addr, lba, (uint32_t)cblock);
-
-		FLAGS_CF_SET(core, 0);
+		bios_disk_result(core, bios_harddisk_readsector(d, addr, lba, (uint32_t)cblock));
 
 		break;
 	case 0x03:  // 写扇区
@@ -263,7 +413,7 @@ void bios_ivt_directdiskservice(cpu8086_core_t* core){
 		c = (uint8_t)(core->reg.cx >> 8); //柱面
 		s = (uint8_t)(core->reg.cx); 	  //扇区
 		h = (uint8_t)(core->reg.dx >> 8); //磁头
-		d = (uint8_t)(core->reg.dx);	  //驱动器, 无用
+		d = (uint8_t)(core->reg.dx);	  //驱动器
 		
 		H = HDISK_H; //每磁柱磁头数
 		S = HDISK_S; //每磁道扇区数
@@ -272,9 +422,7 @@ void bios_ivt_directdiskservice(cpu8086_core_t* core){
 		
 		addr = vm_addr_calc(core->reg.es, core->reg.bx);
 
-		bios_harddisk_writesector(addr, lba, (uint32_t)cblock);
-
-		FLAGS_CF_SET(core, 0);
+		bios_disk_result(core, bios_harddisk_writesector(d, addr, lba, (uint32_t)cblock));
 
 		break;
 	case 0x04:  // 验扇区 未实现
@@ -285,7 +433,42 @@ void bios_ivt_directdiskservice(cpu8086_core_t* core){
 		break;
 	case 0x07:  // 格式化驱动器 未实现
 		break;
-	case 0x08:  // 读取驱动器参数 未实现
+	case 0x08:  // 读取驱动器参数
+		//CHS最多1024个柱面, 更大的磁盘需要使用扩展功能
+		if(bios_harddisk_sectors((uint8_t)core->reg.dx) == 0){
+			bios_disk_result(core, -1);
+			break;
+		}
+
+		c16 = bios_harddisk_cylinders((uint8_t)core->reg.dx);
+		c16 = c16 == 0 ? 0 : (c16 > 1024 ? 1024 : c16) - 1;
+
+		core->reg.cx = (uint16_t)((c16 & 0xff) << 8) | (uint16_t)((c16 >> 2) & 0xc0) | HDISK_S;
+		core->reg.dx = (uint16_t)((HDISK_H - 1) << 8) | (uint16_t)bios_harddisk_count();	//最大磁头号, 驱动器数
+		bios_disk_result(core, 0);
+
+		break;
+	case 0x41:  // 检查扩展功能
+		if(core->reg.bx != 0x55aa || bios_harddisk_sectors((uint8_t)core->reg.dx) == 0){
+			bios_disk_result(core, -1);
+			break;
+		}
+
+		core->reg.bx = 0xaa55;
+		core->reg.cx = 0x0001;	//支持42h-44h, 47h, 48h
+		bios_disk_result(core, 0);
+		core->reg.ax = (core->reg.ax & 0x00ff) | 0x2100; //EDD 1.1
+
+		break;
+	case 0x42:  // 扩展读
+	case 0x43:  // 扩展写
+	case 0x44:  // 扩展校验, 只检查范围
+	case 0x47:  // 扩展查寻, 只检查范围
+		bios_disk_result(core, bios_disk_packet(core, ah));
+		break;
+	case 0x48:  // 读取扩展驱动器参数
+		bios_disk_result(core, bios_disk_param(core));
+		break;
 	case 0x09:  // 初始化硬盘参数 未实现
 	case 0x0A:  // 读长扇区 未实现
 		break;
@@ -334,3 +517,19 @@ void bios_ivt_parallelportservice(cpu8086_core_t* core){
 void bios_ivt_clockservice(cpu8086_core_t* core){
 	return;
 }
+
+/*
+ * IRQ14: 与pc bios相同, 置位0040:008E的硬盘中断标志后结束中断
+ */
+void bios_ivt_harddiskirq(cpu8086_core_t* core){
+	vm_write_byte(0x48e, 0xff);
+
+	interupt_eoi(14);
+}
+
+//IRQ15: secondary通道, 与IRQ14相同
+void bios_ivt_harddiskirq2(cpu8086_core_t* core){
+	vm_write_byte(0x48e, 0xff);
+
+	interupt_eoi(15);
+}
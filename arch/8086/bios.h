@@ -4,8 +4,26 @@
 #include <stdint.h>
 
 /*
- * 执行Bios中断处理函数,n(a中断号)
+ * bios只读映像位于0xf0000, 每个中断向量在映像中对应一个入口:
+ *     F000:E000 + n*4    0F FF n  陷阱指令, 调用C实现的中断服务
+ *                        CF       iret
+ * 中断向量表在初始化时指向这些入口, -r指定的外部映像必须在相同位置提供全部入口
  */
-void bios_ivt_exec_8086(uint8_t n);
+#define BIOS_ROM_SEGMENT	0xf000
+#define BIOS_ROM_STUB_BASE	0xe000
+#define BIOS_ROM_STUB_SIZE	4
+#define BIOS_TRAP_OPCODE	0x0f	//8086的pop cs, 只有后跟BIOS_TRAP_MARK时作为陷阱, pop cs ff不能使用
+#define BIOS_TRAP_MARK		0xff
+
+/*
+ * 加载bios映像并初始化中断向量表, path为NULL时使用生成的映像
+ * 成功返回1
+ */
+int bios_init_8086(const char* path);
+
+/*
+ * 执行映像中的陷阱指令, 调用第n号中断的C服务并从中断返回
+ */
+void bios_ivt_trap_8086(uint8_t n);
 
 #endif
@@ -8,6 +8,7 @@
 #include "8086/mem.h"
 #include "8086/pci.h"
 #include "config.h"
+#include "interupt.h"
 
 #define SWAP(x,y) do{typeof(x) __t = (x); (x) = (y); (y) = __t;}while(0)
 
@@ -240,6 +241,7 @@ int instruct_process_or_rm2reg_16(struct operand* oper);
 int instruct_process_or_i8al(struct operand* oper);
 int instruct_process_or_i16ax(struct operand* oper);
 int instruct_process_push_cs(struct operand* oper);
+int instruct_process_bios_trap(struct operand* oper);
 int instruct_process_adc_reg2rm_8(struct operand* oper);
 int instruct_process_adc_reg2rm_16(struct operand* oper);
 int instruct_process_adc_rm2reg_8(struct operand* oper);
@@ -452,20 +454,21 @@ int instruct_process_table_ff(struct operand* oper);
  * #################指令处理函数##########################
  */
 
+/*
+ * sp指向栈顶的字: 压栈先移动sp再写入, 出栈先读取再移动sp
+ */
 static void push_stack_16(cpu8086_core_t* core, uint16_t reg){
-	assert(core && reg);
-
-	addr_t addr = vm_addr_calc(core->reg.ss, core->reg.sp);
-	vm_write_word(addr, reg);
+	assert(core);
 
 	core->reg.sp -= 2;
+
+	vm_write_word_seg(core->reg.ss, core->reg.sp, reg);
 }
 
 static void pop_stack_16(cpu8086_core_t* core, uint16_t* reg){
 	assert(core && reg);
 
-	addr_t addr = vm_addr_calc(core->reg.ss, core->reg.sp);
-	*reg = vm_read_word(addr);
+	*reg = vm_read_word_seg(core->reg.ss, core->reg.sp);
 
 	core->reg.sp += 2;
 }
@@ -494,7 +497,7 @@ struct cpu8086_instruction{
 	{parse_format_imm_8, instruct_process_or_i8al},				//0x0c
 	{parse_format_imm_16, instruct_process_or_i16ax},			//0x0d
 	{NULL, instruct_process_push_cs},							//0x0e
-	{NULL, NULL},												//0x0f	
+	{NULL, instruct_process_bios_trap},							//0x0f	
 	{parse_format_reg2rm_8, instruct_process_adc_reg2rm_8}, 	//0x10
 	{parse_format_reg2rm_16, instruct_process_adc_reg2rm_16}, 	//0x11
 	{parse_format_reg2rm_8, instruct_process_adc_rm2reg_8},		//0x12
@@ -1254,11 +1257,7 @@ int instruct_process_adc_i16ax(struct operand* oper){
 int instruct_process_push_ss(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	uint16_t oldsp = core->reg.sp;
-	core->reg.sp -= 2;
-
-	addr_t addr = vm_addr_calc(core->reg.ss, oldsp);
-	vm_write_word(addr, core->reg.ss);
+	push_stack_16(core, core->reg.ss);
 
 	vm_fprintf(stdout, "push ss\n");
 
@@ -1472,7 +1471,7 @@ int instruct_process_push_ds(struct operand* oper){
 int instruct_process_pop_ds(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	pop_stack_16(core, core->reg.ds);
+	pop_stack_16(core, &core->reg.ds);
 
 	vm_fprintf(stdout, "pop ds\n");
 
@@ -3872,11 +3871,7 @@ int instruct_process_pop_rm16(struct operand* oper){
 
 	cpu8086_core_t *core = get_core();
 
-	uint16_t oldsp = core->reg.sp;
-	core->reg.sp += 2;
-
-	addr_t addr = vm_addr_calc(core->reg.ss, oldsp);
-	s = vm_read_word(addr);
+	pop_stack_16(core, &s);
 
 	if(oper->operand2_type == OPERAND_ADDR){
 		vm_write_word(oper->operand2.addr, s);
@@ -4028,13 +4023,8 @@ int instruct_process_call_far(struct operand* oper){
 
 	cpu8086_core_t* core = get_core();
 
-	uint16_t oldsp = core->reg.sp;
-	addr_t addr = vm_addr_calc(core->reg.ss, oldsp);
-	vm_write_word(addr, core->reg.ip);
-	core->reg.sp -= 2;
-
-	addr-= 2;
-	vm_write_word(addr, core->reg.cs);
+	push_stack_16(core, core->reg.cs);
+	push_stack_16(core, core->reg.ip);
 
 	core->reg.cs = segment;
 	core->reg.ip = offset;
@@ -4053,11 +4043,7 @@ int instruct_process_wait(struct operand* oper){
 int instruct_process_pushf(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	uint16_t oldsp = core->reg.sp;
-	core->reg.sp -= 2;
-
-	addr_t addr = vm_addr_calc(core->reg.ss, oldsp);
-	vm_write_word(addr, core->reg.flags);
+	push_stack_16(core, core->reg.flags);
 
 	vm_fprintf(stdout, "pushf\n");
 
@@ -4067,11 +4053,7 @@ int instruct_process_pushf(struct operand* oper){
 int instruct_process_popf(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	uint16_t oldsp = core->reg.sp;
-	core->reg.sp += 2;
-
-	addr_t addr = vm_addr_calc(core->reg.ss, oldsp);
-	core->reg.flags = vm_read_word(addr);
+	pop_stack_16(core, &core->reg.flags);
 
 	vm_fprintf(stdout, "popf\n");
 
@@ -4208,12 +4190,9 @@ int instruct_process_movsw_16(struct operand* oper){
 	uint16_t ds = core->reg.ds;
 	uint16_t es = core->reg.es;
 
-	addr_t s = vm_addr_calc(ds, si);
-	addr_t d = vm_addr_calc(es, di);
-
-	uint16_t sw = vm_read_word(s);
+	uint16_t sw = vm_read_word_seg(ds, si);
 
-	vm_write_word(d, sw);
+	vm_write_word_seg(es, di, sw);
 
 	if(FLAGS_DF(core) == 0){
 		core->reg.si+=2;
@@ -4274,11 +4253,8 @@ int instruct_process_cmps_16(struct operand* oper){
 	uint16_t ds = core->reg.ds;
 	uint16_t es = core->reg.es;
 
-	addr_t sa = vm_addr_calc(ds, si);
-	addr_t da = vm_addr_calc(es, di);
-
-	uint16_t s = vm_read_word(sa);
-	uint16_t d = vm_read_word(da);
+	uint16_t s = vm_read_word_seg(ds, si);
+	uint16_t d = vm_read_word_seg(es, di);
 
 	uint16_t old = d;
 	d = d - s; 
@@ -4356,10 +4332,8 @@ int instruct_process_stos_8(struct operand* oper){
 	vm_write_byte(addr, al);
 
 	if(FLAGS_DF(core) == 0){
-		core->reg.si++;
 		core->reg.di++;
 	} else {
-		core->reg.si--;
 		core->reg.di--;
 	}
 
@@ -4375,16 +4349,13 @@ int instruct_process_stos_16(struct operand* oper){
 	uint16_t di = core->reg.di;
 	uint16_t es = core->reg.es;
 
-	addr_t addr = vm_addr_calc(es, di);
-
-	vm_write_word(addr, ax);
+	vm_write_word_seg(es, di, ax);
 
+	//stosw只移动di, 步长为一个字
 	if(FLAGS_DF(core) == 0){
-		core->reg.si++;
-		core->reg.di++;
+		core->reg.di += 2;
 	} else {
-		core->reg.si--;
-		core->reg.di--;
+		core->reg.di -= 2;
 	}
 
 	vm_fprintf(stdout,"stosw\n");
@@ -4396,19 +4367,17 @@ int instruct_process_lods_8(struct operand* oper){
 	cpu8086_core_t *core = get_core();
 
 	uint8_t* al = (uint8_t*)&core->reg.ax;
-	uint16_t di = core->reg.di;
-	uint16_t es = core->reg.es;
+	uint16_t si = core->reg.si;
+	uint16_t ds = core->reg.ds;
 
-	addr_t addr = vm_addr_calc(es, di);
+	addr_t addr = vm_addr_calc(ds, si);
 
 	*al = vm_read_byte(addr);
 
 	if(FLAGS_DF(core) == 0){
 		core->reg.si++;
-		core->reg.di++;
 	} else {
 		core->reg.si--;
-		core->reg.di--;
 	}
 
 	vm_fprintf(stdout,"lodsb\n");
@@ -4420,19 +4389,16 @@ int instruct_process_lods_16(struct operand* oper){
 	cpu8086_core_t *core = get_core();
 
 	uint16_t* ax = &core->reg.ax;
-	uint16_t di = core->reg.di;
-	uint16_t es = core->reg.es;
-
-	addr_t addr = vm_addr_calc(es, di);
+	uint16_t si = core->reg.si;
+	uint16_t ds = core->reg.ds;
 
-	*ax = vm_read_word(addr);
+	//lodsw从ds:si读取, 只移动si, 步长为一个字
+	*ax = vm_read_word_seg(ds, si);
 
 	if(FLAGS_DF(core) == 0){
-		core->reg.si++;
-		core->reg.di++;
+		core->reg.si += 2;
 	} else {
-		core->reg.si--;
-		core->reg.di--;
+		core->reg.si -= 2;
 	}
 
 	vm_fprintf(stdout,"lodsw\n");
@@ -4486,11 +4452,8 @@ int instruct_process_scas_16(struct operand* oper){
 	uint16_t ds = core->reg.ds;
 	uint16_t es = core->reg.es;
 
-	addr_t sa = vm_addr_calc(ds, si);
-	addr_t da = vm_addr_calc(es, di);
-
-	uint16_t s = vm_read_word(sa);
-	uint16_t d = vm_read_word(da);
+	uint16_t s = vm_read_word_seg(ds, si);
+	uint16_t d = vm_read_word_seg(es, di);
 
 	uint16_t old = s;
 	d = s - d; 
@@ -4712,7 +4675,9 @@ int instruct_process_ret_im16(struct operand* oper){
 	uint16_t im = oper->operand1.im;
 	cpu8086_core_t *core = get_core();
 
-	core->reg.ip = im;
+	//返回后再释放im字节的参数
+	pop_stack_16(core, &core->reg.ip);
+	core->reg.sp += im;
 
 	vm_fprintf(stdout, "ret %s\n", oper->alias_operand1);
 
@@ -4722,13 +4687,7 @@ int instruct_process_ret_im16(struct operand* oper){
 int instruct_process_ret(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	uint16_t oldsp = core->reg.sp;
-	core->reg.sp += 2;
-
-	addr_t addr = vm_addr_calc(core->reg.ss, oldsp);
-	uint16_t offset = vm_read_word(addr);
-
-	core->reg.ip = offset;
+	pop_stack_16(core, &core->reg.ip);
 
 	vm_fprintf(stdout, "ret\n", oper->alias_operand1);
 
@@ -4823,12 +4782,9 @@ int instruct_process_retf_im16(struct operand* oper){
 	uint16_t im = oper->operand1.im;
 	cpu8086_core_t *core = get_core();
 
-	addr_t addr = vm_addr_calc(core->reg.ss, core->reg.sp);
-	core->reg.sp += 2;
-
-	core->reg.cs = vm_read_word(addr);
-
-	core->reg.ip = im;
+	pop_stack_16(core, &core->reg.ip);
+	pop_stack_16(core, &core->reg.cs);
+	core->reg.sp += im;
 
 	vm_fprintf(stdout, "ret %s\n", oper->alias_operand1);
 
@@ -4839,13 +4795,8 @@ int instruct_process_retf_im16(struct operand* oper){
 int instruct_process_retf(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	addr_t addr = vm_addr_calc(core->reg.ss, core->reg.sp);
-	uint16_t offset = vm_read_word(addr);
-
-	core->reg.ip = offset;
-	core->reg.cs = vm_read_word(addr + 2);
-
-	core->reg.sp += 4;
+	pop_stack_16(core, &core->reg.ip);
+	pop_stack_16(core, &core->reg.cs);
 
 	vm_fprintf(stdout, "ret\n", oper->alias_operand1);
 
@@ -4862,8 +4813,9 @@ int instruct_process_int3(struct operand* oper){
 	push_stack_16(core, core->reg.cs);
 	push_stack_16(core, core->reg.ip);
 
-	core->reg.cs = (uint16_t)3 * 4 + 2;
-	core->reg.ip = (uint16_t)3 * 4;
+	//从中断向量表中获取中断服务入口
+	core->reg.ip = vm_read_word((addr_t)3 * 4);
+	core->reg.cs = vm_read_word((addr_t)3 * 4 + 2);
 
 	vm_fprintf(stdout, "int3\n");
 
@@ -4880,10 +4832,37 @@ int instruct_process_int(struct operand* oper){
 	push_stack_16(core, core->reg.cs);
 	push_stack_16(core, core->reg.ip);
 
-	core->reg.cs = (uint16_t)im * 4 + 2;
-	core->reg.ip = (uint16_t)im * 4;
+	//从中断向量表中获取中断服务入口
+	core->reg.ip = vm_read_word((addr_t)im * 4);
+	core->reg.cs = vm_read_word((addr_t)im * 4 + 2);
 
 	vm_fprintf(stdout, "int %d\n", im);
+
+	return 0;
+}
+
+/*
+ * 0x0f在8086上是pop cs, 后面紧跟0xff时是bios映像中的陷阱指令 0F FF n,
+ * 进入C实现的第n号中断服务
+ */
+int instruct_process_bios_trap(struct operand* oper){
+	cpu8086_core_t * core = get_core();
+
+	if(vm_read_byte(vm_addr_calc(core->reg.cs, core->reg.ip)) != BIOS_TRAP_MARK){
+		pop_stack_16(core, &core->reg.cs);
+
+		vm_fprintf(stdout, "pop cs\n");
+
+		return 0;
+	}
+
+	uint16_t im = instruct_read_word();
+
+	bios_ivt_trap_8086((uint8_t)(im >> 8));
+
+	vm_fprintf(stdout, "bios trap 0x%02x\n", (uint8_t)(im >> 8));
+
+	return 0;
 }
 
 int instruct_process_into(struct operand* oper){
@@ -4895,8 +4874,9 @@ int instruct_process_into(struct operand* oper){
 	push_stack_16(core, core->reg.cs);
 	push_stack_16(core, core->reg.ip);
 
-	core->reg.cs = (uint16_t)4 * 4 + 2;
-	core->reg.ip = (uint16_t)4 * 4;
+	//从中断向量表中获取中断服务入口
+	core->reg.ip = vm_read_word((addr_t)4 * 4);
+	core->reg.cs = vm_read_word((addr_t)4 * 4 + 2);
 
 	vm_fprintf(stdout, "into\n");
 
@@ -4906,9 +4886,9 @@ int instruct_process_into(struct operand* oper){
 int instruct_process_iret(struct operand* oper){
 	cpu8086_core_t* core = get_core();
 
-	push_stack_16(core, core->reg.ip);
-	push_stack_16(core, core->reg.cx);
-	push_stack_16(core, core->reg.flags);
+	pop_stack_16(core, &core->reg.ip);
+	pop_stack_16(core, &core->reg.cs);
+	pop_stack_16(core, &core->reg.flags);
 
 	vm_fprintf(stdout, "iret\n");
 
@@ -5496,13 +5476,7 @@ int instruct_process_call_near(struct operand* oper){
 
 	cpu8086_core_t* core = get_core();
 
-	uint16_t oldsp = core->reg.sp;
-	addr_t addr = vm_addr_calc(core->reg.ss, oldsp);
-	vm_write_word(addr, core->reg.ip);
-	core->reg.sp -= 2;
-
-	addr-= 2;
-	vm_write_word(addr, core->reg.cs);
+	push_stack_16(core, core->reg.ip);
 
 	core->reg.ip = offset;
 
@@ -5560,8 +5534,7 @@ int instruct_process_inaldx(struct operand* oper){
 int instruct_process_inaxdx(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	core->reg.ax = core->reg.ax & 0xff00;
-	core->reg.ax |= pci_in_word(core->reg.dx);
+	core->reg.ax = pci_in_word(core->reg.dx);
 
 	vm_fprintf(stdout, "in ax, dx\n");
 
@@ -5571,7 +5544,7 @@ int instruct_process_inaxdx(struct operand* oper){
 int instruct_process_outaldx(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	pci_out_byte(core->reg.cx, (uint8_t)core->reg.ax);
+	pci_out_byte(core->reg.dx, (uint8_t)core->reg.ax);
 
 	vm_fprintf(stdout, "out al, dx\n");
 
@@ -5581,7 +5554,7 @@ int instruct_process_outaldx(struct operand* oper){
 int instruct_process_outaxdx(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
-	pci_out_word(core->reg.cx, core->reg.ax);
+	pci_out_word(core->reg.dx, core->reg.ax);
 
 	vm_fprintf(stdout, "out ax, dx\n");
 
@@ -5637,6 +5610,14 @@ int instruct_process_repe(struct operand* opers){
 int instruct_process_halt(struct operand* oper){
 	cpu8086_core_t * core = get_core();
 
+	//允许中断时等待外部中断唤醒, 超时后重新执行hlt, 使cpu线程能够响应挂起
+	if(FLAGS_IF(core)){
+		if(!interupt_wait(10)){
+			core->reg.ip = core->oldip;
+		}
+		return 0;
+	}
+
 	while(core->halt == 0){
 		;
 	}
@@ -5958,16 +5939,22 @@ int instruct_process_stc(struct operand* oper){
 int instruct_process_cli(struct operand* oper){
 	cpu8086_core_t* core = get_core();
 
-	update_flags(FLAGS_I, 0);
+	core->reg.flags &= ~0x0200;	//外部中断依赖IF, 直接修改
 
 	vm_fprintf(stdout,"cli\n");
 	return 0;
 }
 
+//sti之后的一条指令执行完才响应中断, 使sti; hlt不会错过中断
+static int g_cpu8086_sti_shadow = 0;
+
 int instruct_process_sti(struct operand* oper){
 	cpu8086_core_t* core = get_core();
 
-	update_flags(FLAGS_I, 1);
+	if(!FLAGS_IF(core)){
+		g_cpu8086_sti_shadow = 1;
+	}
+	core->reg.flags |= 0x0200;
 
 	vm_fprintf(stdout,"sti\n");
 	return 0;
@@ -6143,12 +6130,38 @@ static int cpu8086_proc_instruction(void){
 	return nbyteproc;
 }
 
+/*
+ * 响应中断控制器的外部中断, 与int指令相同地压栈并清除IF/TF
+ */
+static void cpu8086_interupt(cpu8086_core_t* core){
+	int vector = interupt_ack();
+	if(vector < 0){
+		return;
+	}
+
+	push_stack_16(core, core->reg.flags);
+	core->reg.flags &= ~0x0300;
+	push_stack_16(core, core->reg.cs);
+	push_stack_16(core, core->reg.ip);
+
+	core->reg.ip = vm_read_word((addr_t)vector * 4);
+	core->reg.cs = vm_read_word((addr_t)vector * 4 + 2);
+
+	vm_fprintf(stdout, "interupt %d\n", vector);
+}
+
 /*
  * cpu处理主函数
  */
 int cpu8086_proc(){
 	cpu8086_core_t * core = get_core();
 
+	if(g_cpu8086_sti_shadow){
+		g_cpu8086_sti_shadow = 0;
+	} else if(FLAGS_IF(core) && interupt_pending()){
+		cpu8086_interupt(core);
+	}
+
 	core->oldip = core->reg.ip;
 
 	return cpu8086_proc_instruction();
@@ -6163,30 +6176,30 @@ static addr_t addr_rm_mod0(uint8_t op){
 
 	switch(op){
 		case 0:
-			addr = (addr_t)core->reg.ds * 16 + (addr_t)core->reg.bx + (addr_t)core->reg.si;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + core->reg.si);
 			break;
 		case 1:
-			addr = (addr_t)core->reg.ds * 16 + (addr_t)core->reg.bx + (addr_t)core->reg.di;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + core->reg.di);
 			break;
 		case 2:
-			addr = (addr_t)core->reg.ss * 16 + (addr_t)core->reg.bp + (addr_t)core->reg.si;
+			addr = vm_addr_calc(core->reg.ss, core->reg.bp + core->reg.si);
 			break;
 		case 3:
-			addr = (addr_t)core->reg.ss * 16 + (addr_t)core->reg.bp + (addr_t)core->reg.di;
+			addr = vm_addr_calc(core->reg.ss, core->reg.bp + core->reg.di);
 			break;
 		case 4:
-			addr = (addr_t)core->reg.ds * 16 + (addr_t)core->reg.si;
+			addr = vm_addr_calc(core->reg.ds, core->reg.si);
 			break;
 		case 5:
-			addr = (addr_t)core->reg.ds * 16 + (addr_t)core->reg.di;
+			addr = vm_addr_calc(core->reg.ds, core->reg.di);
 			break;
 		case 6:
 			//addr = (addr_t)core->reg.ds * 16 + disp;
 			disp = instruct_read_word();
-			addr = vm_addr_calc(core->reg.ds * 16, disp);
+			addr = vm_addr_calc(core->reg.ds, disp);
 			break;
 		case 7:
-			addr = (addr_t)core->reg.ds * 16 + (addr_t)core->reg.bx;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx);
 			break;                              
 	}                                       
 	return addr;                            
@@ -6282,35 +6295,35 @@ static addr_t addr_rm_mod1(uint8_t op){
 	switch(op){
 		case 0:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bx + core->reg.si + disp8;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + core->reg.si + disp8);
 			break;
 		case 1:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bx + core->reg.di + disp8;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + core->reg.di + disp8);
 			break;
 		case 2:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ss * 16 + core->reg.bp + core->reg.si + disp8;
+			addr = vm_addr_calc(core->reg.ss, core->reg.bp + core->reg.si + disp8);
 			break;
 		case 3:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ss * 16 + core->reg.bp + core->reg.di + disp8;
+			addr = vm_addr_calc(core->reg.ss, core->reg.bp + core->reg.di + disp8);
 			break;
 		case 4:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.si + disp8;
+			addr = vm_addr_calc(core->reg.ds, core->reg.si + disp8);
 			break;
 		case 5:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.di + disp8;
+			addr = vm_addr_calc(core->reg.ds, core->reg.di + disp8);
 			break;
 		case 6:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bp + disp8;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bp + disp8);
 			break;
 		case 7:
 			disp8 = instruct_read_byte();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bx + disp8;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + disp8);
 			break;
 	}
 
@@ -6369,35 +6382,35 @@ static addr_t addr_rm_mod2(uint8_t op){
 	switch(op){
 		case 0:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bx + core->reg.si + disp16;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + core->reg.si + disp16);
 			break;
 		case 1:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bx + core->reg.di + disp16;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + core->reg.di + disp16);
 			break;
 		case 2:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ss * 16 + core->reg.bp + core->reg.si + disp16;
+			addr = vm_addr_calc(core->reg.ss, core->reg.bp + core->reg.si + disp16);
 			break;
 		case 3:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ss * 16 + core->reg.bp + core->reg.di + disp16;
+			addr = vm_addr_calc(core->reg.ss, core->reg.bp + core->reg.di + disp16);
 			break;
 		case 4:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.si + disp16;
+			addr = vm_addr_calc(core->reg.ds, core->reg.si + disp16);
 			break;
 		case 5:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.di + disp16;
+			addr = vm_addr_calc(core->reg.ds, core->reg.di + disp16);
 			break;
 		case 6:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bp + disp16;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bp + disp16);
 			break;
 		case 7:
 			disp16 = instruct_read_word();
-			addr = (addr_t)core->reg.ds * 16 + core->reg.bx + disp16;
+			addr = vm_addr_calc(core->reg.ds, core->reg.bx + disp16);
 			break;
 	}
 
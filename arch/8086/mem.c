@@ -1,8 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "8086/cpu.h"
 #include "8086/mem.h"
+#include "util/util_lz.h"
 #include "vgui.h"
 #include "config.h"
 
@@ -36,200 +44,402 @@ struct vm_mem{
 
 //定义全局的内存结构体
 static struct vm_mem * g_vm_mem = NULL;
+static uint8_t* g_vm_ptr = NULL;
+
+//内存之后的保护区域, 与第0页映射到同一物理页
+#define VM_MEM_GUARD 4096
+//此地址之后的写入需要额外处理(显示适配器, bios只读区域)
+#define VM_MEM_SLOW  0xb8000
+
+#define VM_CODE_PAGES (sizeof(struct vm_mem) >> VM_CODE_PAGE_SHIFT)
+
+//是否映射了公共内存映像
+static int g_base_mapped = 0;
+//外部bios映像的大小, 0表示使用生成的映像
+static uint32_t g_rom_size = 0;
+
+/*
+ * 已登记的代码块, 挂在起始地址所在代码页的链表上
+ */
+struct vm_code_block{
+	addr_t begin;
+	addr_t end;		//不包含end
+	void* block;	//缓存的代码块
+	struct vm_code_block* next;
+};
+
+//代码页位图,置位表示该页上存在已缓存的代码块
+static uint8_t g_code_bitmap[VM_CODE_PAGES / 8] = {0};
+static struct vm_code_block* g_code_blocks[VM_CODE_PAGES] = {0};
+static vm_code_flush_func g_code_flush = NULL;
+static struct vm_code_stats g_code_stats = {0, 0, 0};
+
+#define VM_CODE_PAGE_TEST(p) (g_code_bitmap[(p) >> 3] & (1 << ((p) & 7)))
+
+static void vm_code_invalidate(addr_t maddr, uint32_t length);
+static int vm_store_byte(addr_t maddr, uint8_t byte);
+
+//检查不跨越0xfffff的[maddr, maddr + length)
+static inline void vm_code_check_range(addr_t maddr, uint32_t length){
+	uint32_t page = maddr >> VM_CODE_PAGE_SHIFT;
+	uint32_t last = (maddr + length - 1) >> VM_CODE_PAGE_SHIFT;
+
+	for(; page <= last; page++){
+		if(VM_CODE_PAGE_TEST(page)){
+			vm_code_invalidate(maddr, length);
+			return;
+		}
+	}
+}
+
+/*
+ * 写内存前检查代码页位图,普通数据页只有位图检查的开销
+ * 在0xfffff处回绕的写入分为两段, 回绕到0开始的部分同样检查
+ */
+static inline void vm_code_check(addr_t maddr, uint32_t length){
+	if(length > VM_MEM_SIZE){
+		length = VM_MEM_SIZE;
+	}
+
+	if(maddr + length <= VM_MEM_SIZE){
+		vm_code_check_range(maddr, length);
+		return;
+	}
+
+	vm_code_check_range(maddr, VM_MEM_SIZE - maddr);
+	vm_code_check_range(0, maddr + length - VM_MEM_SIZE);
+}
 
 int vm_init(void){
-	g_vm_mem = (struct vm_mem*)calloc(sizeof(struct vm_mem), 1);
+	assert(sizeof(struct vm_mem) == VM_MEM_SIZE);
 
-	if(g_vm_mem == NULL){
+	//按页对齐分配, 以便bios区域可以单独映射为只读
+	uint8_t* mem = (uint8_t*)mmap(NULL, VM_MEM_SIZE + VM_MEM_GUARD, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(mem == MAP_FAILED){
 		vm_fprintf(stderr, "vm_init failed!\n");
 		return 0;
 	}
 
+	//第0页与保护区域共享同一物理页, 实现1MiB处的回绕
+	int fd = memfd_create("vm_mem_wrap", 0);
+	if(fd < 0 || ftruncate(fd, VM_MEM_GUARD) < 0
+			|| mmap(mem, VM_MEM_GUARD, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+			|| mmap(mem + VM_MEM_SIZE, VM_MEM_GUARD, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED){
+		vm_fprintf(stderr, "vm_init map wrap page failed!\n");
+		if(fd >= 0){
+			close(fd);
+		}
+		munmap(mem, VM_MEM_SIZE + VM_MEM_GUARD);
+		return 0;
+	}
+
+	close(fd);
+
+	g_vm_mem = (struct vm_mem*)mem;
+	g_vm_ptr = mem;
+
 	return 1;
 }
 
-uint8_t vm_read_byte(addr_t maddr){
-	uint8_t m_byte = 0;
-
-	if(maddr <= 0x3ff){
-		m_byte = g_vm_mem->ivt[maddr];
-	} else if(maddr >= 0x400 && maddr <= 0xfff ){
-		m_byte = g_vm_mem->biosda[maddr - 0x400];
-	} else if(maddr >= 0x500 && maddr <= 0x7bff ){
-		m_byte = g_vm_mem->a[maddr - 0x500];
-	} else if(maddr >= 0x7c00 && maddr <= 0x7dff ){
-		m_byte = g_vm_mem->mbr[maddr - 0x7c00];
-	} else if(maddr >= 0x7e00 && maddr <= 0x9fbff ){
-		m_byte = g_vm_mem->b[maddr - 0x7e00];
-	} else if(maddr >= 0x9fc00 && maddr <= 0x9ffff ){
-		m_byte = g_vm_mem->ebda[maddr - 0x9fc00];
-	} else if(maddr >= 0xa0000 && maddr <= 0xaffff ){
-		m_byte = g_vm_mem->c_adapter[maddr - 0xa0000];
-	} else if(maddr >= 0xb0000 && maddr <= 0xb7fff ){
-		m_byte = g_vm_mem->bw_adapter[maddr - 0xb0000];
-	} else if(maddr >= 0xb8000 && maddr <= 0xbffff ){
-		m_byte = g_vm_mem->t_adapter[maddr - 0xb8000];
-	} else if(maddr >= 0xc0000 && maddr <= 0xc7fff ){
-		m_byte = g_vm_mem->adapter[maddr - 0xc0000];
-	} else if(maddr >= 0xc8000 && maddr <= 0xe7fff ){
-		m_byte = g_vm_mem->rom[maddr - 0xc8000];
-	} else if(maddr >= 0xf0000 && maddr <= 0xfffff ){
-		m_byte = g_vm_mem->bios[maddr - 0xf0000];
-	} else {
-		vm_fprintf(stderr,"memory %u overlap\n",maddr);
-		m_byte = 0;
+/*
+ * 以写时复制方式映射公共的内存基础映像, 多个guest共享未修改的页,
+ * 只有首次写入的页才会成为guest的私有页
+ */
+int vm_base_map(const char* path){
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0){
+		vm_fprintf(stderr, "can not open memory image %s\n", path);
+		return -1;
+	}
+
+	if(fstat(fd, &st) < 0 || st.st_size != (off_t)sizeof(struct vm_mem)){
+		vm_fprintf(stderr, "bad memory image size %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+	//第0页为回绕共享页, 不能替换其映射, 直接读入
+	uint8_t page[VM_MEM_GUARD];
+	if(pread(fd, page, sizeof(page), 0) != sizeof(page)){
+		vm_fprintf(stderr, "read memory image %s failed\n", path);
+		close(fd);
+		return -1;
+	}
+
+	if(memcmp(g_vm_ptr, page, sizeof(page)) != 0){
+		memcpy(g_vm_ptr, page, sizeof(page));
+	}
+
+	void* addr = mmap(g_vm_ptr + VM_MEM_GUARD, VM_MEM_SIZE - VM_MEM_GUARD, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, VM_MEM_GUARD);
+
+	close(fd);
+
+	if(addr == MAP_FAILED){
+		vm_fprintf(stderr, "map memory image %s failed\n", path);
+		return -1;
 	}
 
-	return m_byte;
+	g_base_mapped = 1;
+
+	return 0;
 }
 
-uint16_t vm_read_word(addr_t maddr){
-	uint16_t m_word = 0;
+/*
+ * 保存当前内存作为基础映像
+ */
+int vm_base_save(const char* path){
+	uint8_t* mem = (uint8_t*)g_vm_mem;
+	uint32_t size = sizeof(struct vm_mem);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-	if(maddr < 0x3ff){
-		m_word = *(uint16_t*)(&(g_vm_mem->ivt[maddr]));
-	} else if(maddr >= 0x400 && maddr < 0xfff ){
-		m_word = *(uint16_t*)(&g_vm_mem->biosda[maddr - 0x400]);
-	} else if(maddr >= 0x500 && maddr < 0x7bff ){
-		m_word = *(uint16_t*)(&g_vm_mem->a[maddr - 0x500]);
-	} else if(maddr >= 0x7c00 && maddr < 0x7dff ){
-		m_word = *(uint16_t*)(&g_vm_mem->mbr[maddr - 0x7c00]);
-	} else if(maddr >= 0x7e00 && maddr < 0x9fbff ){
-		m_word = *(uint16_t*)(&g_vm_mem->b[maddr - 0x7e00]);
-	} else if(maddr >= 0x9fc00 && maddr < 0x9ffff){
-		m_word = *(uint16_t*)(&g_vm_mem->ebda[maddr - 0x9fc00]);
-	} else if(maddr >= 0xa0000 && maddr < 0xaffff ){
-		m_word = *(uint16_t*)(&g_vm_mem->c_adapter[maddr - 0xa0000]);
-	} else if(maddr >= 0xb0000 && maddr < 0xb7fff ){
-		m_word = *(uint16_t*)(&g_vm_mem->bw_adapter[maddr - 0xb0000]);
-	} else if(maddr >= 0xb8000 && maddr < 0xbffff ){
-		m_word = *(uint16_t*)(&g_vm_mem->t_adapter[maddr - 0xb8000]);
-	} else if(maddr >= 0xc0000 && maddr < 0xc7fff ){
-		m_word = *(uint16_t*)(&g_vm_mem->adapter[maddr - 0xc0000]);
-	} else if(maddr >= 0xc8000 && maddr < 0xe7fff ){
-		m_word = *(uint16_t*)(&g_vm_mem->rom[maddr - 0xc8000]);
-	} else if(maddr >= 0xf0000 && maddr < 0xfffff ){
-		m_word = *(uint16_t*)(&g_vm_mem->bios[maddr - 0xf0000]);
-	} else {
-		vm_fprintf(stderr,"memory %u overlap\n",maddr);
-		m_word = 0;
+	if(fd < 0){
+		vm_fprintf(stderr, "can not create memory image %s\n", path);
+		return -1;
 	}
 
-	return m_word;
+	while(size > 0){
+		ssize_t n = write(fd, mem, size);
+		if(n <= 0){
+			vm_fprintf(stderr, "write memory image %s failed\n", path);
+			close(fd);
+			return -1;
+		}
+
+		mem  += n;
+		size -= n;
+	}
+
+	close(fd);
+
+	return 0;
 }
 
 /*
- * 写内存同时需要执行对应的动作，如bw_adapter需要在展示对应的黑白窗口
+ * 统计guest私有内存的大小(字节), 即内存区域中匿名页的总和,
+ * 基础映像中未被修改的页不计算在内
  */
-int vm_write_byte(addr_t maddr, uint8_t byte){
-	if(maddr <= 0x3ff){
-		g_vm_mem->ivt[maddr] = byte;
-	} else if(maddr >= 0x400 && maddr <= 0xfff ){
-		g_vm_mem->biosda[maddr - 0x400] = byte;
-	} else if(maddr >= 0x500 && maddr <= 0x7bff ){
-		g_vm_mem->a[maddr - 0x500] = byte;
-	} else if(maddr >= 0x7c00 && maddr <= 0x7dff ){
-		g_vm_mem->mbr[maddr - 0x7c00] = byte;
-	} else if(maddr >= 0x7e00 && maddr <= 0x9fbff ){
-		g_vm_mem->b[maddr - 0x7e00] = byte;
-	} else if(maddr >= 0x9fc00 && maddr <= 0x9ffff ){
-		g_vm_mem->ebda[maddr - 0x9fc00] = byte;
-	} else if(maddr >= 0xa0000 && maddr <= 0xaffff ){
-		//print_color(0xa0000, 0x010000);
-		//暂不支持彩色显示适配器
-
-		g_vm_mem->c_adapter[maddr - 0xa0000] = byte;
-	} else if(maddr >= 0xb0000 && maddr <= 0xb7fff ){
-		//print_bw(0xb0000, 0x8000);
-		//暂不支持黑白显示适配器
-
-		g_vm_mem->bw_adapter[maddr - 0xb0000] = byte;
-	} else if(maddr >= 0xb8000 && maddr <= 0xbffff ){
-		if(maddr % 2 == 0){
-			addr_t addr = maddr;
-			uint32_t nword = (maddr - 0xb8000) / 2;
-			uint32_t x = nword % VGIO_WIDTH;
-			uint32_t y = nword / VGIO_WIDTH;
-
-			//vgui_cursor_set(x, y);
-			vgui_set_char(byte);
+uint32_t vm_private_size(void){
+	char line[256];
+	unsigned long begin = 0, end = 0;
+	unsigned long kb = 0;
+	unsigned long mbegin = (unsigned long)g_vm_mem;
+	unsigned long mend = mbegin + sizeof(struct vm_mem);
+	uint32_t size = 0;
+	int inside = 0;
+	int wrap = 0;
+
+	FILE* fp = fopen("/proc/self/smaps", "r");
+	if(fp == NULL){
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), fp)){
+		if(sscanf(line, "%lx-%lx ", &begin, &end) == 2){
+			inside = (begin >= mbegin && end <= mend);
+			//第0页为共享映射, 但属于guest私有
+			wrap = (begin == mbegin && end == mbegin + VM_MEM_GUARD);
+		} else if(inside && sscanf(line, "Anonymous: %lu kB", &kb) == 1){
+			size += kb * 1024;
+		} else if(wrap && sscanf(line, "Rss: %lu kB", &kb) == 1){
+			size += kb * 1024;
 		}
+	}
 
-		g_vm_mem->t_adapter[maddr - 0xb8000] = byte;
-	} else if(maddr >= 0xc0000 && maddr <= 0xc7fff ){
-		g_vm_mem->adapter[maddr - 0xc0000] = byte;
-	} else if(maddr >= 0xc8000 && maddr <= 0xe7fff ){
-		g_vm_mem->rom[maddr - 0xc8000] = byte;
-	} else if(maddr >= 0xf0000 && maddr <= 0xfffff ){
-		g_vm_mem->bios[maddr - 0xf0000] = byte;
-	} else {
-		vm_fprintf(stderr,"memory %u overlap\n",maddr);
+	fclose(fp);
+
+	return size;
+}
+
+/*
+ * 将bios映像只读映射到0xf0000 - 0xfffff的顶端, 保证复位向量位于0xffff0
+ * 映像大小需为4KiB的整数倍, 且不超过64KiB
+ */
+int vm_rom_map(const char* path){
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0){
+		vm_fprintf(stderr, "can not open bios rom %s\n", path);
+		return -1;
+	}
+
+	if(fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > (off_t)sizeof(g_vm_mem->bios)
+			|| st.st_size % 4096 != 0){
+		vm_fprintf(stderr, "bad bios rom size %s\n", path);
+		close(fd);
 		return -1;
 	}
 
+	uint8_t* rom = g_vm_mem->bios + sizeof(g_vm_mem->bios) - st.st_size;
+	void* addr = mmap(rom, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+
+	close(fd);
+
+	if(addr == MAP_FAILED){
+		vm_fprintf(stderr, "map bios rom %s failed\n", path);
+		return -1;
+	}
+
+	g_rom_size = (uint32_t)st.st_size;
+
+	//映像之外的部分同样只读
+	if(rom != g_vm_mem->bios){
+		mprotect(g_vm_mem->bios, rom - g_vm_mem->bios, PROT_READ);
+	}
+
 	return 0;
 }
 
 /*
- * 写内存同时需要执行对应的动作，如bw_adapter需要在展示对应的黑白窗口
+ * 写入生成的bios映像后调用, 之后bios区域只读
  */
-int vm_write_word(addr_t maddr, uint16_t word){
-	if(maddr < 0x3ff){
-		((uint16_t*)g_vm_mem->ivt)[maddr] = word;
-	} else if(maddr >= 0x400 && maddr < 0xfff ){
-		((uint16_t*)g_vm_mem->biosda)[maddr - 0x400] = word;
-	} else if(maddr >= 0x500 && maddr < 0x7bff ){
-		((uint16_t*)g_vm_mem->a)[maddr - 0x500] = word;
-	} else if(maddr >= 0x7c00 && maddr < 0x7dff ){
-		((uint16_t*)g_vm_mem->mbr)[maddr - 0x7c00] = word;
-	} else if(maddr >= 0x7e00 && maddr < 0x9fbff ){
-		((uint16_t*)g_vm_mem->b)[maddr - 0x7e00] = word;
-	} else if(maddr >= 0x9fc00 && maddr < 0x9ffff ){
-		((uint16_t*)g_vm_mem->ebda)[maddr - 0x9fc00] = word;
-	} else if(maddr >= 0xa0000 && maddr < 0xaffff ){
-		((uint16_t*)g_vm_mem->c_adapter)[maddr - 0xa0000] = word;
-	} else if(maddr >= 0xb0000 && maddr < 0xb7fff ){
-		((uint16_t*)g_vm_mem->bw_adapter)[maddr - 0xb0000] = word;
-	} else if(maddr >= 0xb8000 && maddr < 0xbffff ){
-		if(maddr % 2 == 0){
-			addr_t addr = maddr;
-		} else {
-			addr_t addr = maddr + 1;
-		}
+int vm_rom_protect(void){
+	return mprotect(g_vm_mem->bios, sizeof(g_vm_mem->bios), PROT_READ);
+}
+
+void* vm_rom(void){
+	return g_vm_mem->bios;
+}
+
+uint32_t vm_rom_size(void){
+	return g_rom_size ? g_rom_size : sizeof(g_vm_mem->bios);
+}
+
+/*
+ * 物理地址在1MiB处回绕, 内存之后的保护页映射到第0页,
+ * 跨越0xfffff的字访问无需分支即可读到回绕后的数据
+ */
+uint8_t vm_read_byte(addr_t maddr){
+	return g_vm_ptr[maddr & VM_MEM_MASK];
+}
+
+uint16_t vm_read_word(addr_t maddr){
+	uint16_t m_word = 0;
 
-		uint32_t nword = (maddr - 0xb8000) / 2;
-		uint32_t x = nword % VGIO_WIDTH;
-		uint32_t y = nword / VGIO_WIDTH;
+	memcpy(&m_word, g_vm_ptr + (maddr & VM_MEM_MASK), sizeof(m_word));
 
-		vgui_cursor_set(x, y);
-		vgui_set_char((uint8_t)(word & 0x00ff));
+	return m_word;
+}
+
+uint32_t vm_read_dword(addr_t maddr){
+	uint32_t m_word = 0;
+
+	memcpy(&m_word, g_vm_ptr + (maddr & VM_MEM_MASK), sizeof(m_word));
+
+	return m_word;
+}
+
+int vm_read(addr_t maddr, uint8_t* buffer, uint32_t length){
+	uint32_t i = 0;
+
+	maddr &= VM_MEM_MASK;
+
+	if(maddr + length <= VM_MEM_SIZE){
+		memcpy(buffer, g_vm_ptr + maddr, length);
+		return 0;
+	}
 
-		((uint16_t*)g_vm_mem->t_adapter)[maddr - 0xb8000] = word;
-	} else if(maddr >= 0xc0000 && maddr < 0xc7fff ){
-		((uint16_t*)&g_vm_mem->adapter)[maddr - 0xc0000] = word;
-	} else if(maddr >= 0xc8000 && maddr < 0xe7fff ){
-		((uint16_t*)&g_vm_mem->rom)[maddr - 0xc8000] = word;
-	} else if(maddr >= 0xf0000 && maddr < 0xfffff ){
-		((uint16_t*)&g_vm_mem->bios)[maddr - 0xf0000] = word;
+	for(; i < length; i++){
+		buffer[i] = g_vm_ptr[(maddr + i) & VM_MEM_MASK];
+	}
+
+	return 0;
+}
+
+int vm_write_byte(addr_t maddr, uint8_t byte){
+	maddr &= VM_MEM_MASK;
+
+	vm_code_check(maddr, 1);
+
+	if(maddr < VM_MEM_SLOW){
+		g_vm_ptr[maddr] = byte;
+		return 0;
+	}
+
+	return vm_store_byte(maddr, byte);
+}
+
+/*
+ * 0xb8000之后的区域写内存同时需要执行对应的动作
+ */
+static int vm_store_byte(addr_t maddr, uint8_t byte){
+	if(maddr >= 0xb8000 && maddr <= 0xbffff ){
+		g_vm_mem->t_adapter[maddr - 0xb8000] = byte;
+		vgui_text_write(maddr - 0xb8000, &byte, 1);
+	} else if(maddr >= 0xf0000 && maddr <= 0xfffff ){
+		//bios区域只读, 写入被忽略
+		;
 	} else {
-		vm_fprintf(stderr,"memory %u overlap\n",maddr);
-		return -1;
+		g_vm_ptr[maddr] = byte;
 	}
 
 	return 0;
 }
 
-int vm_write(addr_t maddr, uint8_t* content, uint16_t length){
-	int i = 0;
-	int rcode = 0;
+int vm_write_word(addr_t maddr, uint16_t word){
+	maddr &= VM_MEM_MASK;
+
+	vm_code_check(maddr, 2);
+
+	if(maddr + 1 < VM_MEM_SLOW){
+		memcpy(g_vm_ptr + maddr, &word, sizeof(word));
+		return 0;
+	}
+
+	if(maddr >= 0xb8000 && maddr < 0xbffff ){
+		memcpy(&g_vm_mem->t_adapter[maddr - 0xb8000], &word, sizeof(word));
+		vgui_text_write(maddr - 0xb8000, &g_vm_mem->t_adapter[maddr - 0xb8000], sizeof(word));
+
+		return 0;
+	}
+
+	//跨越区域边界或在0xfffff处回绕, 按字节写入
+	vm_store_byte(maddr, (uint8_t)word);
+	vm_write_byte(maddr + 1, (uint8_t)(word >> 8));
+
+	return 0;
+}
+
+int vm_write(addr_t maddr, uint8_t* content, uint32_t length){
+	uint32_t i = 0;
+
+	if(length == 0){
+		return 0;
+	}
+
+	maddr &= VM_MEM_MASK;
+
+	//整块只检查一次代码页,覆盖的代码块一次性刷新
+	vm_code_check(maddr, length);
+
+	if(maddr + length <= VM_MEM_SLOW){
+		memcpy(g_vm_ptr + maddr, content, length);
+		return 0;
+	}
+
+	//整块落在文本缓冲区内时一次同步到共享内存
+	if(maddr >= 0xb8000 && maddr + length <= 0xc0000){
+		memcpy(&g_vm_mem->t_adapter[maddr - 0xb8000], content, length);
+		vgui_text_write(maddr - 0xb8000, content, length);
+		return 0;
+	}
+
 	for(; i < length; i++){
-		rcode = vm_write_byte(maddr + i, content[i]);
-		if(rcode < 0){
-			break;
+		addr_t addr = (maddr + i) & VM_MEM_MASK;
+
+		if(addr < VM_MEM_SLOW){
+			g_vm_ptr[addr] = content[i];
+		} else {
+			vm_store_byte(addr, content[i]);
 		}
 	}
 
-	return rcode;
+	return 0;
 }
 
 //读取指令信息
@@ -245,14 +455,33 @@ uint8_t instruct_read_byte(){
 uint16_t instruct_read_word(){
 	cpu8086_core_t * core = get_core();
 
-	addr_t addr = vm_addr_calc(core->reg.cs, core->reg.ip);
+	uint16_t word = vm_read_word_seg(core->reg.cs, core->reg.ip);
 	core->reg.ip += 2;
 
-	return vm_read_word(addr);
+	return word;
 }
 
 addr_t vm_addr_calc(uint16_t base, uint16_t offset){
-	return (addr_t)base * 16 + (addr_t)offset;
+	return ((addr_t)base * 16 + (addr_t)offset) & VM_MEM_MASK;
+}
+
+/*
+ * 按段:偏移访问字, 偏移0xffff处的高字节在段内回绕到seg:0000
+ */
+uint16_t vm_read_word_seg(uint16_t base, uint16_t offset){
+	if(offset != 0xffff)
+		return vm_read_word(vm_addr_calc(base, offset));
+
+	return vm_read_byte(vm_addr_calc(base, offset)) |
+		(uint16_t)vm_read_byte(vm_addr_calc(base, 0)) << 8;
+}
+
+int vm_write_word_seg(uint16_t base, uint16_t offset, uint16_t word){
+	if(offset != 0xffff)
+		return vm_write_word(vm_addr_calc(base, offset), word);
+
+	vm_write_byte(vm_addr_calc(base, offset), (uint8_t)word);
+	return vm_write_byte(vm_addr_calc(base, 0), (uint8_t)(word >> 8));
 }
 
 uint32_t vm_size(void){
@@ -270,48 +499,351 @@ void* vm_mbr(void){
 	return g_vm_mem->mbr;
 }
 
-int vm_read(addr_t maddr, uint8_t* buffer, uint16_t length){
-	int i = 0;
-	for(; i < length; i++){
-		buffer[i] = vm_read_byte(maddr + i);
+uint32_t vm_mbr_size(void){
+	return sizeof(g_vm_mem->mbr) + sizeof(g_vm_mem->b);
+}
+
+void vm_code_flush_set(vm_code_flush_func func){
+	g_code_flush = func;
+}
+
+/*
+ * 重新计算代码页位图, 第page页可能被本页或者上一页开始的代码块覆盖
+ */
+static void vm_code_page_update(uint32_t page){
+	struct vm_code_block* cb = NULL;
+	addr_t pbegin = (addr_t)page << VM_CODE_PAGE_SHIFT;
+	int used = (g_code_blocks[page] != NULL);
+
+	if(!used && page > 0){
+		for(cb = g_code_blocks[page - 1]; cb; cb = cb->next){
+			if(cb->end > pbegin){
+				used = 1;
+				break;
+			}
+		}
+	}
+
+	if(used){
+		g_code_bitmap[page >> 3] |= (uint8_t)(1 << (page & 7));
+	} else {
+		g_code_bitmap[page >> 3] &= (uint8_t)~(1 << (page & 7));
+	}
+}
+
+/*
+ * 登记缓存的代码块,成功返回0
+ */
+int vm_code_register(addr_t begin, uint16_t length, void* block){
+	if(length == 0 || length > VM_CODE_BLOCK_MAX){
+		return -1;
+	}
+
+	if(begin + length > sizeof(struct vm_mem)){
+		return -1;
+	}
+
+	struct vm_code_block* cb = (struct vm_code_block*)malloc(sizeof(struct vm_code_block));
+	if(cb == NULL){
+		return -1;
+	}
+
+	uint32_t page = begin >> VM_CODE_PAGE_SHIFT;
+
+	cb->begin = begin;
+	cb->end   = begin + length;
+	cb->block = block;
+	cb->next  = g_code_blocks[page];
+	g_code_blocks[page] = cb;
+
+	for(; page <= ((cb->end - 1) >> VM_CODE_PAGE_SHIFT); page++){
+		g_code_bitmap[page >> 3] |= (uint8_t)(1 << (page & 7));
 	}
 
 	return 0;
 }
 
-uint32_t vm_read_dword(addr_t maddr){
-	uint32_t m_word = 0;
+/*
+ * 代码块被缓存自身淘汰时注销, 不会触发回调
+ */
+void vm_code_unregister(addr_t begin, void* block){
+	uint32_t page = begin >> VM_CODE_PAGE_SHIFT;
+	struct vm_code_block** pcb = NULL;
+
+	if(page >= VM_CODE_PAGES){
+		return;
+	}
+
+	for(pcb = &g_code_blocks[page]; *pcb; pcb = &(*pcb)->next){
+		if((*pcb)->block == block && (*pcb)->begin == begin){
+			struct vm_code_block* cb = *pcb;
+			*pcb = cb->next;
+			free(cb);
+
+			vm_code_page_update(page);
+			if(page + 1 < VM_CODE_PAGES){
+				vm_code_page_update(page + 1);
+			}
+			return;
+		}
+	}
+}
 
-	if(maddr < 0x3ff){
-		m_word = ((uint32_t*)g_vm_mem->ivt)[maddr];
-	} else if(maddr >= 0x400 && maddr < 0xfff ){
-		m_word = ((uint32_t*)g_vm_mem->biosda)[maddr - 0x400];
-	} else if(maddr >= 0x500 && maddr < 0x7bff ){
-		m_word = ((uint32_t*)g_vm_mem->a)[maddr - 0x500];
-	} else if(maddr >= 0x7c00 && maddr < 0x7dff ){
-		m_word = ((uint32_t*)g_vm_mem->mbr)[maddr - 0x7c00];
-	} else if(maddr >= 0x7e00 && maddr < 0x9fbff ){
-		m_word = ((uint32_t*)g_vm_mem->b)[maddr - 0x7e00];
-	} else if(maddr >= 0x9fc00 && maddr < 0x9ffff ){
-		m_word = ((uint32_t*)g_vm_mem->ebda)[maddr - 0x9fc00];
-	} else if(maddr >= 0xa0000 && maddr < 0xaffff ){
-		m_word = ((uint32_t*)g_vm_mem->c_adapter)[maddr - 0xa0000];
-	} else if(maddr >= 0xb0000 && maddr < 0xb7fff ){
-		m_word = ((uint32_t*)g_vm_mem->bw_adapter)[maddr - 0xb0000];
-	} else if(maddr >= 0xb8000 && maddr < 0xbffff ){
-		m_word = ((uint32_t*)g_vm_mem->t_adapter)[maddr - 0xb8000];
-	} else if(maddr >= 0xc0000 && maddr < 0xc7fff ){
-		m_word = ((uint32_t*)&g_vm_mem->adapter)[maddr - 0xc0000];
-	} else if(maddr >= 0xc8000 && maddr < 0xe7fff ){
-		m_word = ((uint32_t*)&g_vm_mem->rom)[maddr - 0xc8000];
-	} else if(maddr >= 0xf0000 && maddr < 0xfffff ){
-		m_word = ((uint32_t*)&g_vm_mem->bios)[maddr - 0xf0000];
+/*
+ * 刷新与[maddr, maddr + length)重叠的代码块, 区间不跨越0xfffff
+ */
+static void vm_code_invalidate(addr_t maddr, uint32_t length){
+	uint32_t first = maddr >> VM_CODE_PAGE_SHIFT;
+	uint32_t last = (maddr + length - 1) >> VM_CODE_PAGE_SHIFT;
+	uint32_t page = 0;
+	uint64_t flushed = 0;
+	addr_t end = maddr + length;
+
+	//起始页之前一页开始的代码块可能跨入起始页
+	page = first > 0 ? first - 1 : 0;
+
+	for(; page <= last; page++){
+		struct vm_code_block** pcb = &g_code_blocks[page];
+
+		while(*pcb){
+			struct vm_code_block* cb = *pcb;
+
+			if(cb->begin < end && cb->end > maddr){
+				*pcb = cb->next;
+
+				if(g_code_flush){
+					g_code_flush(cb->block);
+				}
+				free(cb);
+				flushed++;
+			} else {
+				pcb = &cb->next;
+			}
+		}
+	}
+
+	page = first > 0 ? first - 1 : 0;
+	for(; page <= last + 1 && page < VM_CODE_PAGES; page++){
+		vm_code_page_update(page);
+	}
+
+	g_code_stats.events++;
+	g_code_stats.flushed += flushed;
+	if(flushed == 0){
+		g_code_stats.missed++;
+	}
+}
+
+void vm_code_stats_get(struct vm_code_stats* stats){
+	assert(stats);
+
+	*stats = g_code_stats;
+}
+
+#define VM_PARK_PAGE_SHIFT 12
+#define VM_PARK_PAGE_SIZE  (1 << VM_PARK_PAGE_SHIFT)
+#define VM_PARK_PAGES      (sizeof(struct vm_mem) >> VM_PARK_PAGE_SHIFT)
+
+#define VM_PAGE_RESIDENT 0
+#define VM_PAGE_ZERO	 1
+#define VM_PAGE_PACKED	 2
+
+struct vm_park_page{
+	uint8_t  state;
+	uint16_t size;	//压缩后的大小, 等于页大小时为原始数据
+	uint8_t* data;
+};
+
+static struct vm_park_page g_park_pages[VM_PARK_PAGES];
+static struct vm_park_stats g_park_stats;
+static int g_parked = 0;
+
+static uint64_t vm_park_clock(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int vm_park_in_rom(uint8_t* p){
+	return p >= g_vm_mem->bios && p < g_vm_mem->bios + sizeof(g_vm_mem->bios);
+}
+
+/*
+ * 解压第i页, 先解压到临时缓冲区, 页面可访问时内容已经完整
+ */
+static void vm_park_restore(uint32_t i){
+	struct vm_park_page* pg = &g_park_pages[i];
+	uint8_t* p = (uint8_t*)g_vm_mem + ((addr_t)i << VM_PARK_PAGE_SHIFT);
+	uint8_t buffer[VM_PARK_PAGE_SIZE];
+
+	if(pg->state == VM_PAGE_PACKED && pg->size != VM_PARK_PAGE_SIZE){
+		vm_lz_decompress(pg->data, pg->size, buffer, VM_PARK_PAGE_SIZE);
+	}
+
+	mprotect(p, VM_PARK_PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+	if(pg->state == VM_PAGE_ZERO){
+		//匿名页释放后读出即为0, 公共内存映像的页会恢复成映像内容
+		if(g_base_mapped){
+			memset(p, 0, VM_PARK_PAGE_SIZE);
+		}
 	} else {
-		vm_fprintf(stderr,"memory %u overlap\n",maddr);
-		m_word = 0;
+		memcpy(p, pg->size == VM_PARK_PAGE_SIZE ? pg->data : buffer, VM_PARK_PAGE_SIZE);
 	}
 
-	return m_word;
+	if(vm_park_in_rom(p)){
+		mprotect(p, VM_PARK_PAGE_SIZE, PROT_READ);
+	}
+
+	pg->state = VM_PAGE_RESIDENT;
+}
+
+//释放已解压页面保留的压缩数据
+static void vm_park_release(void){
+	uint32_t i = 0;
+
+	for(; i < VM_PARK_PAGES; i++){
+		if(g_park_pages[i].state == VM_PAGE_RESIDENT && g_park_pages[i].data){
+			free(g_park_pages[i].data);
+			g_park_pages[i].data = NULL;
+		}
+	}
+}
+
+/*
+ * 读取pagemap, 只有驻留的匿名私有页才需要压缩
+ * 未访问过的页以及公共映像中未修改的页直接跳过
+ */
+static int vm_park_pagemap(uint64_t* entries){
+	int fd = open("/proc/self/pagemap", O_RDONLY);
+	off_t off = (off_t)((uintptr_t)g_vm_mem / getpagesize()) * sizeof(uint64_t);
+	ssize_t size = VM_PARK_PAGES * sizeof(uint64_t);
+
+	if(fd < 0){
+		return -1;
+	}
+
+	if(getpagesize() != VM_PARK_PAGE_SIZE || pread(fd, entries, size, off) != size){
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
 }
 
+int vm_park(void){
+	static uint64_t entries[VM_PARK_PAGES];
+	static uint8_t buffer[VM_PARK_PAGE_SIZE];
+	uint32_t i = 0;
+	int pagemap = 0;
+
+	if(g_parked){
+		return 0;
+	}
+
+	vm_park_release();
+	pagemap = (vm_park_pagemap(entries) == 0);
+
+	for(; i < VM_PARK_PAGES; i++){
+		struct vm_park_page* pg = &g_park_pages[i];
+		uint8_t* p = (uint8_t*)g_vm_mem + ((addr_t)i << VM_PARK_PAGE_SHIFT);
+		int n = 0;
+
+		//上次挂起后未被访问的页仍处于压缩状态
+		if(pg->state != VM_PAGE_RESIDENT){
+			continue;
+		}
 
+		//bit63 驻留, bit62 已换出, bit61 文件页或共享匿名页
+		if(pagemap){
+			uint64_t e = entries[i];
+
+			if((e & (3ull << 62)) == 0 || (e & (1ull << 61))){
+				continue;
+			}
+		}
+
+		if(p[0] == 0 && memcmp(p, p + 1, VM_PARK_PAGE_SIZE - 1) == 0){
+			pg->state = VM_PAGE_ZERO;
+		} else {
+			n = vm_lz_compress(p, VM_PARK_PAGE_SIZE, buffer, VM_PARK_PAGE_SIZE - 1);
+			if(n < 0){
+				n = VM_PARK_PAGE_SIZE;
+			}
+
+			pg->data = (uint8_t*)malloc(n);
+			if(pg->data == NULL){
+				continue;
+			}
+
+			memcpy(pg->data, n == VM_PARK_PAGE_SIZE ? p : buffer, n);
+			pg->size = (uint16_t)n;
+			pg->state = VM_PAGE_PACKED;
+		}
+
+		madvise(p, VM_PARK_PAGE_SIZE, MADV_DONTNEED);
+		mprotect(p, VM_PARK_PAGE_SIZE, PROT_NONE);
+	}
+
+	//统计所有处于挂起状态的页
+	g_park_stats.pages = 0;
+	g_park_stats.zero_pages = 0;
+	g_park_stats.raw_bytes = 0;
+	g_park_stats.packed_bytes = 0;
+
+	for(i = 0; i < VM_PARK_PAGES; i++){
+		struct vm_park_page* pg = &g_park_pages[i];
+
+		if(pg->state == VM_PAGE_RESIDENT){
+			continue;
+		}
+
+		g_park_stats.pages++;
+		g_park_stats.raw_bytes += VM_PARK_PAGE_SIZE;
+
+		if(pg->state == VM_PAGE_ZERO){
+			g_park_stats.zero_pages++;
+		} else {
+			g_park_stats.packed_bytes += pg->size;
+		}
+	}
+
+	g_parked = 1;
+
+	return 0;
+}
+
+/*
+ * 在cpu恢复运行之前解压全部页面
+ * 磁盘读写等内核对guest内存的访问不会触发缺页处理, 不能等到首次访问时再解压
+ */
+int vm_unpark(void){
+	uint64_t begin = vm_park_clock();
+	uint32_t i = 0;
+
+	if(!g_parked){
+		return 0;
+	}
+
+	for(; i < VM_PARK_PAGES; i++){
+		if(g_park_pages[i].state != VM_PAGE_RESIDENT){
+			vm_park_restore(i);
+		}
+	}
+
+	vm_park_release();
+
+	g_parked = 0;
+	g_park_stats.resume_ns = vm_park_clock() - begin;
+
+	return 0;
+}
+
+void vm_park_stats_get(struct vm_park_stats* stats){
+	assert(stats);
+
+	*stats = g_park_stats;
+}
@@ -3,6 +3,9 @@
 
 typedef uint32_t addr_t;
 
+#define VM_MEM_SIZE 0x100000 	//1MiB, 物理地址在此处回绕
+#define VM_MEM_MASK (VM_MEM_SIZE - 1)
+
 int vm_init(void);
 
 //指定内存读写
@@ -10,11 +13,11 @@ uint8_t vm_read_byte(addr_t maddr);
 uint16_t vm_read_word(addr_t maddr);
 uint32_t vm_read_dword(addr_t maddr);
 
-int vm_read(addr_t maddr, uint8_t* buffer, uint16_t length);
+int vm_read(addr_t maddr, uint8_t* buffer, uint32_t length);
 
 int vm_write_byte(addr_t maddr, uint8_t byte);
 int vm_write_word(addr_t maddr, uint16_t word);
-int vm_write(addr_t maddr, uint8_t* content, uint16_t length);
+int vm_write(addr_t maddr, uint8_t* content, uint32_t length);
 
 //读取指令信息
 uint8_t instruct_read_byte();
@@ -25,7 +28,64 @@ uint32_t vm_size(void);
 //获取内存地址
 void* vm_addr(void);
 void* vm_mbr(void);
+//从MBR开始到EBDA之前可以连续加载引导程序的字节数
+uint32_t vm_mbr_size(void);
+
+//写时复制的公共内存映像
+int vm_base_map(const char* path);
+int vm_base_save(const char* path);
+//guest私有内存大小
+uint32_t vm_private_size(void);
+
+/*
+ * 空闲guest内存的压缩挂起
+ * 挂起时压缩私有页并释放原内存, 恢复时全部解压
+ */
+struct vm_park_stats{
+	uint32_t pages;			//最近一次挂起时压缩的页数
+	uint32_t zero_pages;	//其中全零的页数
+	uint64_t raw_bytes;		//压缩前大小
+	uint64_t packed_bytes;	//压缩后大小
+	uint64_t resume_ns;		//最近一次恢复的耗时
+};
+
+int vm_park(void);
+int vm_unpark(void);
+void vm_park_stats_get(struct vm_park_stats* stats);
+
+//bios只读映像
+int vm_rom_map(const char* path);
+int vm_rom_protect(void);
+void* vm_rom(void);
+//bios映像映射在0xf0000 - 0xfffff顶端的字节数
+uint32_t vm_rom_size(void);
 
 addr_t vm_addr_calc(uint16_t base, uint16_t offset);
+//段内回绕的字访问
+uint16_t vm_read_word_seg(uint16_t base, uint16_t offset);
+int vm_write_word_seg(uint16_t base, uint16_t offset, uint16_t word);
+
+/*
+ * 自修改代码检测
+ * 缓存了译码/翻译结果的代码块需通过vm_code_register登记,
+ * 写入登记过的代码页时只刷新与写入范围重叠的代码块
+ */
+#define VM_CODE_PAGE_SHIFT 8 	//代码页大小256Byte
+#define VM_CODE_PAGE_SIZE  (1 << VM_CODE_PAGE_SHIFT)
+#define VM_CODE_BLOCK_MAX  VM_CODE_PAGE_SIZE //单个代码块最大长度,最多跨2个代码页
+
+//代码块失效回调, block为登记时传入的代码块
+typedef void (*vm_code_flush_func)(void* block);
+
+struct vm_code_stats{
+	uint64_t events;	//写入代码页的次数
+	uint64_t flushed;	//被刷新的代码块数
+	uint64_t missed;	//写入代码页但未与任何代码块重叠的次数
+};
+
+void vm_code_flush_set(vm_code_flush_func func);
+int vm_code_register(addr_t begin, uint16_t length, void* block);
+void vm_code_unregister(addr_t begin, void* block);
+void vm_code_stats_get(struct vm_code_stats* stats);
 
 #endif
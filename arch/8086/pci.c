@@ -20,15 +20,22 @@ int pci_init(void){
 
 uint8_t pci_in_byte(uint16_t port){
 	if(g_pci_port[port].pci_func_in_8){
-		g_pci_port[port].pci_func_in_8((uint8_t*)&((struct pci_record*)g_pci_port)[port].v);
+		g_pci_port[port].pci_func_in_8(port);
 	}
 
 	return (uint8_t)((struct pci_record*)g_pci_port)[port].v;
 }
 
 uint16_t pci_in_word(uint16_t port){
+	struct pci_record* record = &g_pci_port[port];
+
+	//数据端口的快速路径
+	if(record->pci_func_read_16){
+		return record->pci_func_read_16(record->arg);
+	}
+
 	if(g_pci_port[port].pci_func_in_16){
-		g_pci_port[port].pci_func_in_16(&((struct pci_record*)g_pci_port)[port].v);
+		g_pci_port[port].pci_func_in_16(port);
 	}
 
 	return ((struct pci_record*)g_pci_port)[port].v;
@@ -66,6 +73,11 @@ void pci_register_in_16(uint16_t port, pci_func_in_16_t fun){
 	g_pci_port[port].pci_func_in_16 = fun;
 }
 
+void pci_register_read_16(uint16_t port, pci_func_read_16_t fun, void* arg){
+	g_pci_port[port].arg = arg;
+	g_pci_port[port].pci_func_read_16 = fun;
+}
+
 void pci_setvalue_8(uint16_t port, uint8_t val){
 	g_pci_port[port].v = (uint16_t)val;
 }
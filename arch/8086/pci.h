@@ -5,6 +5,7 @@ typedef void (*pci_func_out_8_t)(uint16_t, uint8_t);
 typedef void (*pci_func_out_16_t)(uint16_t, uint16_t);
 typedef void (*pci_func_in_8_t)(uint16_t);
 typedef void (*pci_func_in_16_t)(uint16_t);
+typedef uint16_t (*pci_func_read_16_t)(void*);
 
 struct pci_record{
 	uint16_t v;			//数据部分
@@ -13,6 +14,8 @@ struct pci_record{
 	pci_func_in_16_t pci_func_in_16;
 	pci_func_out_8_t pci_func_out_8;
 	pci_func_out_16_t pci_func_out_16;
+	pci_func_read_16_t pci_func_read_16; //直接返回数据的读函数, 用于数据端口
+	void* arg;
 };
 
 int pci_init(void);
@@ -30,6 +33,8 @@ void pci_register_out_8(uint16_t port, pci_func_out_8_t fun);
 void pci_register_out_16(uint16_t port, pci_func_out_16_t fun);
 void pci_register_in_8(uint16_t port, pci_func_in_8_t fun);
 void pci_register_in_16(uint16_t port, pci_func_in_16_t fun);
+//注册直接返回数据的读函数, 优先于pci_func_in_16, 不经过v
+void pci_register_read_16(uint16_t port, pci_func_read_16_t fun, void* arg);
 
 //设置v
 void pci_setvalue_8(uint16_t port, uint8_t val);
@@ -16,6 +16,18 @@
 
 struct {
 	char * hdpath;
+	char * hdextra[3];	//其余驱动器: primary从盘, secondary主盘, secondary从盘
+	char * hdbase;		//hdpath不存在时以此为基础映像新建overlay
+	uint32_t hdsize;	//hdpath不存在时新建此大小(MiB)的稀疏映像
+	char * hdstore;		//与hdsize一起使用时改为新建使用此共享块存储的去重映像
+	char * hdraw;		//hdpath不存在时把此原始映像压缩为hdpath
+	uint32_t bootsectors;	//引导时从磁盘起始处加载的扇区数
+	int    hdsync;		//磁盘映像的回写策略 VM_FILE_SYNC_*
+	uint32_t hdflushms;	//VM_FILE_SYNC_PERIODIC的落盘间隔(毫秒)
+	uint32_t hdcache;	//扇区缓存大小(MiB), 0表示不使用缓存
+	char * biospath;	//bios映像, 为NULL时使用生成的映像
+	char * mempath;		//公共内存映像, 多个guest以写时复制方式共享
+	char * memsave;		//加载磁盘后将内存保存为公共内存映像
 } g_config;
 
 #if 0
@@ -6,6 +6,9 @@
 
 #include "cpu.h"
 #include "config.h"
+#ifdef CPU_8086
+	#include "8086/bios.h"
+#endif
 
 static int _cpu_proc(void){
 #ifdef CPU_8086
@@ -16,11 +19,59 @@ static int _cpu_proc(void){
 #endif
 }
 
+/*
+ * 用于挂起和恢复cpu线程
+ */
+static pthread_mutex_t g_cpu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cpu_cond = PTHREAD_COND_INITIALIZER;
+static volatile int g_cpu_suspend = 0; //请求挂起
+static int g_cpu_paused = 0;	//cpu线程已停止
+
+static void cpu_pause(void){
+	pthread_mutex_lock(&g_cpu_mutex);
+
+	g_cpu_paused = 1;
+	pthread_cond_broadcast(&g_cpu_cond);
+
+	while(g_cpu_suspend){
+		pthread_cond_wait(&g_cpu_cond, &g_cpu_mutex);
+	}
+
+	g_cpu_paused = 0;
+	pthread_cond_broadcast(&g_cpu_cond);
+
+	pthread_mutex_unlock(&g_cpu_mutex);
+}
+
+void cpu_suspend(void){
+	pthread_mutex_lock(&g_cpu_mutex);
+
+	g_cpu_suspend = 1;
+	while(!g_cpu_paused){
+		pthread_cond_wait(&g_cpu_cond, &g_cpu_mutex);
+	}
+
+	pthread_mutex_unlock(&g_cpu_mutex);
+}
+
+void cpu_resume(void){
+	pthread_mutex_lock(&g_cpu_mutex);
+
+	g_cpu_suspend = 0;
+	pthread_cond_broadcast(&g_cpu_cond);
+
+	pthread_mutex_unlock(&g_cpu_mutex);
+}
+
 /*
  * cpu指令处理放在一个单独的线程中
  */
 void* cpu_proc_thread(void* arg){
 	while(1){
+		if(g_cpu_suspend){
+			cpu_pause();
+		}
+
 		if(_cpu_proc() < 0){
 			vm_fprintf(stderr,"cpu process error!\n");
 			exit(-1);
@@ -54,3 +105,14 @@ int cpu_init(){
 	return 0;
 }
 
+
+/*
+ * 加载bios映像并初始化中断向量表, 成功返回1
+ */
+int cpu_bios_init(const char* path){
+#ifdef CPU_8086
+	return bios_init_8086(path);
+#endif
+
+	return 0;
+}
@@ -16,6 +16,12 @@ extern cpu_core_t * get_core(void);
 int cpu_init(void);
 //处理cpu指令
 int cpu_proc(void);
+//挂起cpu, 返回时cpu线程已停止执行指令
+void cpu_suspend(void);
+//恢复cpu执行
+void cpu_resume(void);
+//加载bios映像, path为NULL时使用生成的映像
+int cpu_bios_init(const char* path);
 
 #endif
 
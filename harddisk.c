@@ -2,23 +2,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include "mem.h"
+#include "config.h"
 #include "harddisk.h"
+#include "interupt.h"
+#include "8086/pci.h"
 #include "util/util_file.h"
+#include "util/util_cache.h"
 
-struct ide g_ide[2] = {0};
-struct ide_register g_ide_register = {
-	.device = 0,
-	.error = 0,
-	.sector_count = 0,
-	.lba_low = 0,
-	.lba_middle = 0,
-	.lba_high = 0,
-	.device = 0xa0,
-	.status = 0,
-	.command = 0,
-};
-
+struct ide g_ide[2];
 
 static void harddisk_store_lba_l(uint16_t port, uint8_t lba); //lba 0-7
 static void harddisk_store_lba_m(uint16_t port, uint8_t lba); //lba 8-15
@@ -26,259 +21,929 @@ static void harddisk_store_lba_h(uint16_t port, uint8_t lba); //lba 16-23
 static void harddisk_store_lba_e(uint16_t port, uint8_t lba); //lba 24-27
 static void harddisk_sector_count(uint16_t port, uint8_t count);	//设置count
 static void harddisk_command(uint16_t port, uint8_t command); //设置command
-static void harddisk_status(void); 	//获取状态
-static void harddisk_read_8(void); 	//一次读取1个字节
-static void harddisk_read_16(void); //一次读取2个字节
+static void harddisk_control(uint16_t port, uint8_t control); //设备控制寄存器
+static void harddisk_status(uint16_t port); 	//获取状态, 同时清除中断请求
+static void harddisk_altstatus(uint16_t port); 	//获取状态, 不影响中断请求
+static void harddisk_read_8(uint16_t port); 	//一次读取1个字节
+static uint16_t harddisk_data_in_16(void* arg); //一次读取2个字节, 直接返回数据
+static void harddisk_write_16(uint16_t port, uint16_t v); //一次写入2个字节
 
 
+//primary主盘, 用于引导
 static struct hdisk* g_hdisk = NULL;
+//映像无法mmap时bios读写使用的缓冲区, 最多255个扇区
+static uint8_t g_bounce[256 * VM_HDISK_SECTOR];
 static void _init_harddisk(void){
-	g_hdisk = (struct  hdisk*)malloc(sizeof(struct hdisk));
-	assert(g_hdisk != NULL);
+	int i = 0;
+
+	g_hdisk = &g_ide[0].hd[0];
+
+	for(i = 0; i < HDISK_DRIVES; i++){
+		struct hdisk* hd = &g_ide[i / 2].hd[i % 2];
+
+		//数据缓冲区在第一次传输时按需分配
+		hd->buffer = NULL;
+		hd->size  = 0;
+		hd->data  = 0;
+		hd->pos   = 0;
+		hd->disk  = NULL;
+		hd->cache = NULL;
+		hd->ide   = &g_ide[i / 2];
+		memset(&hd->ra, 0, sizeof(hd->ra));
+	}
+}
 
-	g_hdisk->buffer = (uint8_t*)malloc(HDISK_H * HDISK_S * HDISK_M * VM_HDISK_SECTOR);
-	assert(g_hdisk->buffer != NULL);
-	g_hdisk->data  = 0;
-	g_hdisk->pos   = 0;
+//按驱动器位置获取磁盘, 0为primary主盘, 3为secondary从盘
+static struct hdisk* hd_drive(int i){
+	return &g_ide[i / 2].hd[i % 2];
 }
 
+//根据端口获取ide通道
+static struct ide* ide_channel(uint16_t port);
+//获取通道当前选择的主盘或者从盘, 不存在时返回NULL
+static struct hdisk * hd_select(struct ide* ide);
+//经过扇区缓存(如果启用)读写磁盘
+static int hd_read(struct hdisk* hd, uint64_t lba, uint8_t* buffer, uint32_t count);
+static int hd_write(struct hdisk* hd, uint64_t lba, const uint8_t* buffer, uint32_t count);
+//根据读请求的lba序列决定是否预读
+static void hd_readahead(struct hdisk* hd, uint64_t lba, uint32_t count);
+//写回缓存中的脏块并按回写策略等待落盘
+static int hd_flush(struct hdisk* hd);
+//定期落盘的后台线程
+void* harddisk_task_flush(void* arg);
+//记录一次操作的统计
+static void hd_account(struct hdisk* hd, int op, uint32_t sectors, int ret, uint64_t issued);
+static uint64_t hd_now_us(void);
+//保证数据缓冲区至少有bytes字节, 只增长不缩小
+static uint8_t* hd_buffer(struct hdisk* hd, uint64_t bytes);
+
 /*
- * 用于同步线程间对于g_ide_register的读写
+ * 命令完成: 更新状态寄存器, 未屏蔽中断(nIEN)时发出中断请求
+ * 调用时持有通道的锁
  */
-static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static void ide_complete(struct ide* ide, uint8_t status, uint8_t error){
+	ide->reg.status = status;
+	ide->reg.error  = error;
+
+	if(!(ide->control & IDE_CONTROL_NIEN)){
+		interupt_raise(ide->irq);
+	}
+}
+
+//填充identify数据, 字符串按字交换字节序
+static void ide_identify(struct hdisk* hd, uint16_t* id){
+	const char* model = "8086VM HARDDISK";
+	uint32_t sectors = hd->disk->sectors > 0x0fffffff ? 0x0fffffff : (uint32_t)hd->disk->sectors;
+	int len = strlen(model);
+	int i = 0;
+
+	memset(id, 0, VM_HDISK_SECTOR);
+
+	id[0]  = 0x0040;	//固定磁盘
+	id[1]  = (uint16_t)hd->cylinders;
+	id[3]  = HDISK_H;
+	id[6]  = HDISK_S;
+	id[49] = 0x0200;	//支持LBA
+
+	//型号共40个字符, 不足时补空格
+	for(i = 0; i < 40; i++){
+		char c = i < len ? model[i] : ' ';
+		id[27 + i / 2] |= (uint16_t)(uint8_t)c << ((i & 1) ? 0 : 8);
+	}
 
-//获取lba地址
-static uint32_t hd_lba(void);
-//获取主盘或者从盘信息
-static struct hdisk * hd_select(void);
+	id[60] = (uint16_t)sectors;
+	id[61] = (uint16_t)(sectors >> 16);
+}
 
 /*
- * 用于执行命令操作
+ * 每个通道一个命令线程, 执行提交的命令
+ * 磁盘读写时不持有通道的锁, guest可以在此期间继续执行并读取BSY状态
  */
 void* harddisk_task_command(void* arg){
-	struct vm_file_handle * handle = vm_file_handle_create();
-
-	assert(handle != NULL);
+	struct ide* ide = (struct ide*)arg;
 
 	while(1){
-		uint8_t command = g_ide_register.command;
+		pthread_mutex_lock(&ide->mutex);
+		while(!ide->pending){
+			pthread_cond_wait(&ide->cond, &ide->mutex);
+		}
 
-		pthread_mutex_lock(&g_mutex);
-		pthread_cond_wait(&g_cond, &g_mutex);
+		struct ide_request req = ide->req;
+		struct hdisk* hd = &ide->hd[req.drive];
 
-		g_ide_register.status = 0x80;
+		pthread_mutex_unlock(&ide->mutex);
 
-		//获取硬盘信息
-		struct hdisk *hd = hd_select();
-		uint32_t lba = 0;
+		//命令执行期间BSY置位, 没有进行中的数据传输, cpu线程不会访问缓冲区
+		uint8_t status = IDE_STATUS_DRDY;
+		int data = 0;
+		int ret = 0;
+		int op = HDISK_OP_READ;
 
-		switch(command){
-		case 0xec:	//硬盘识别, 待完善
-			break;
-		case 0x20: 	//读扇区
-			if(g_ide_register.sector_count == 0){
-				break;
+		switch(req.command){
+		case 0x20:	//读扇区
+		case 0x21:
+			ret = hd_read(hd, req.lba, hd_buffer(hd, (uint64_t)req.count * VM_HDISK_SECTOR), req.count);
+			if(ret == 0){
+				hd_readahead(hd, req.lba, req.count);
 			}
+			data = 1;
+			break;
+		case 0x30:	//写扇区, 数据已由guest写入缓冲区
+		case 0x31:
+			ret = hd_write(hd, req.lba, hd->buffer, req.count);
+			op = HDISK_OP_WRITE;
+			break;
+		case 0xec:	//硬盘识别
+			ide_identify(hd, (uint16_t*)hd_buffer(hd, VM_HDISK_SECTOR));
+			req.count = 1;
+			data = 1;
+			op = HDISK_OP_IDENTIFY;
+			break;
+		case 0xe7:	//写回缓存并落盘
+			ret = hd_flush(hd);
+			req.count = 0;
+			op = HDISK_OP_FLUSH;
+			break;
+		}
 
-			lba = hd_lba();
-			if(hd->buffer){
-				free(hd->buffer);
-				hd->buffer = NULL;
-			}
+		hd_account(hd, op, req.count, ret, req.issued);
 
-			if(hd->buffer == NULL){
-				hd->data = (uint64_t)g_ide_register.sector_count * VM_HDISK_SECTOR;
-				hd->pos  = 0;
-				hd->buffer = (uint8_t*)malloc(hd->data);
-				assert(hd->pos == NULL);
+		pthread_mutex_lock(&ide->mutex);
 
-				g_ide_register.status = 0x05;
-			}
+		ide->pending = 0;
 
-			//读取文件
-			vm_file_handle_seek(handle, (uint64_t)lba * VM_HDISK_SECTOR);
-			vm_file_handle_read(handle, hd->buffer, hd->data);
+		if(ret < 0){
+			ide_complete(ide, IDE_STATUS_DRDY | IDE_STATUS_ERR, IDE_ERROR_ABRT);
+		} else if(data){
+			//数据就绪, 缓冲区交给cpu线程, 由guest从数据端口读取
+			hd->data   = (uint64_t)req.count * VM_HDISK_SECTOR;
+			hd->pos    = 0;
+			ide->pio_hd = hd;
+			__atomic_store_n(&ide->pio_state, IDE_PIO_IN, __ATOMIC_RELEASE);
+			ide_complete(ide, status | IDE_STATUS_DRQ, 0);
+		} else {
+			ide_complete(ide, status, 0);
+		}
 
-			g_ide_register.status = 0x08;
+		pthread_mutex_unlock(&ide->mutex);
+	}
 
-			break;
-		case 0x30:	//写扇区  待完善
-			break;
-		default:
-			fprintf(stderr, "do not support hd command 0x%02x\n", command);
-			break;
+	return NULL;
+}
+
+/*
+ * 提交命令给通道的命令线程, 调用时持有通道的锁
+ * 与真实的ATA设备相同, 一次只执行一个命令, BSY期间的新命令在harddisk_command中被忽略
+ */
+static void ide_submit(struct ide* ide, struct ide_request* req){
+	ide->req = *req;
+	ide->req.issued = hd_now_us();
+	ide->pending = 1;
+
+	ide->reg.status = IDE_STATUS_BSY;
+	pthread_cond_signal(&ide->cond);
+}
+
+/*
+ * 预读请求, 由通道的预读线程执行, 每块盘只保留最新的一个
+ * 不同通道的顺序流互不干扰, 可以同时进行
+ */
+#define HDISK_RA_MIN_DEPTH	2
+#define HDISK_RA_MAX_DEPTH	32
+#define HDISK_RA_MAX		512	//预读窗口的上限(扇区)
+
+void* harddisk_task_readahead(void* arg){
+	struct ide* ide = (struct ide*)arg;
+	int next = 0;
+
+	while(1){
+		pthread_mutex_lock(&ide->ra_mutex);
+		while(ide->hd[0].ra.count == 0 && ide->hd[1].ra.count == 0){
+			pthread_cond_wait(&ide->ra_cond, &ide->ra_mutex);
+		}
+
+		//主从盘都有请求时轮流执行
+		if(ide->hd[next].ra.count == 0){
+			next ^= 1;
+		}
+
+		struct hdisk* hd = &ide->hd[next];
+		uint64_t lba = hd->ra.lba;
+		uint32_t count = hd->ra.count;
+		hd->ra.count = 0;
+		next ^= 1;
+
+		pthread_mutex_unlock(&ide->ra_mutex);
+
+		if(hd->cache){
+			vm_cache_prefetch(hd->cache, lba, count);
+		} else {
+			vm_disk_prefetch(hd->disk, lba, count);
+		}
+	}
+
+	return NULL;
+}
+
+static void hd_readahead(struct hdisk* hd, uint64_t lba, uint32_t count){
+	struct hdisk_ra* ra = &hd->ra;
+
+	pthread_mutex_lock(&hd->ide->ra_mutex);
+
+	uint64_t step = lba > ra->last ? lba - ra->last : 0;
+
+	//紧接着上一次请求, 或者与上一次步长相同, 都视为顺序流
+	if(step > 0 && (lba == ra->end || (step == ra->stride && step <= HDISK_RA_MAX))){
+		ra->depth = ra->depth ? ra->depth * 2 : HDISK_RA_MIN_DEPTH;
+		if(ra->depth > HDISK_RA_MAX_DEPTH){
+			ra->depth = HDISK_RA_MAX_DEPTH;
 		}
+	} else {
+		ra->depth  = 0;
+		ra->issued = 0;
+	}
+
+	ra->stride = (uint32_t)(step <= HDISK_RA_MAX ? step : 0);
+	ra->last   = lba;
+	ra->end    = lba + count;
+
+	if(ra->depth){
+		//窗口随步长和连续命中的次数增长
+		uint64_t span = (uint64_t)ra->stride * ra->depth;
+		if(span > HDISK_RA_MAX){
+			span = HDISK_RA_MAX;
+		}
+
+		uint64_t from = ra->end > ra->issued ? ra->end : ra->issued;
+		uint64_t to = ra->end + span;
+
+		if(to > from){
+			//与尚未执行的请求相连时合并
+			if(ra->count && from >= ra->lba && from <= ra->lba + ra->count){
+				ra->count = (uint32_t)(to - ra->lba);
+			} else {
+				ra->lba   = from;
+				ra->count = (uint32_t)(to - from);
+			}
+
+			ra->issued = to;
+			pthread_cond_signal(&hd->ide->ra_cond);
+		}
+	}
 
-		pthread_mutex_unlock(&g_mutex);
+	pthread_mutex_unlock(&hd->ide->ra_mutex);
+}
+
+/*
+ * 打开并校验驱动器的磁盘映像, 之后所有读写共用该上下文
+ */
+static int hd_open(struct hdisk* hd, const char* path){
+	hd->disk = vm_disk_open(path, g_config.hdsync);
+	if(hd->disk == NULL){
+		return -1;
+	}
+
+	hd->cylinders = hd->disk->sectors / (HDISK_H * HDISK_S);
+	vm_fprintf(stdout, "harddisk %s: %llu sectors, CHS %u/%u/%u%s\n", path,
+			(unsigned long long)hd->disk->sectors, hd->cylinders, HDISK_H, HDISK_S,
+			hd->disk->addr ? ", mapped" : "");
+	if(hd->disk->type == VM_DISK_COMPRESSED){
+		vm_fprintf(stdout, "harddisk compressed: %u chunks in %llu KiB, read only\n", hd->disk->clusters,
+				(unsigned long long)(hd->disk->index[hd->disk->clusters] - hd->disk->data_offset) / 1024);
+	} else if(hd->disk->type == VM_DISK_DEDUP){
+		vm_fprintf(stdout, "harddisk dedup: %u of %u clusters mapped, %u chunks in store\n",
+				hd->disk->allocated, hd->disk->clusters, vm_disk_dedup_chunks(hd->disk));
+	} else if(hd->disk->type != VM_DISK_RAW){
+		vm_fprintf(stdout, "harddisk %s: %u of %u clusters allocated\n",
+				hd->disk->type == VM_DISK_OVERLAY ? "overlay" : "sparse",
+				hd->disk->allocated, hd->disk->clusters);
+	}
+
+	hd->cache = vm_cache_create(hd->disk, g_config.hdcache);
+	if(hd->cache){
+		vm_fprintf(stdout, "harddisk cache %u MiB\n", g_config.hdcache);
 	}
+
+	return 0;
 }
 
-void harddisk_init(void){
+int harddisk_init(void){
 	pthread_t tid = 0;
+	int i = 0;
 
 	_init_harddisk();
 
-	pthread_create(&tid, NULL, &harddisk_task_command, NULL);
+	//磁盘不存在时按参数新建overlay或稀疏映像, 只写入文件头
+	if(g_config.hdbase && access(g_config.hdpath, F_OK) != 0){
+		if(vm_disk_overlay_create(g_config.hdpath, g_config.hdbase) < 0){
+			vm_fprintf(stderr, "can not create overlay %s on %s\n", g_config.hdpath, g_config.hdbase);
+			return 0;
+		}
+	} else if(g_config.hdraw && access(g_config.hdpath, F_OK) != 0){
+		if(vm_disk_compress_create(g_config.hdpath, g_config.hdraw) < 0){
+			vm_fprintf(stderr, "can not compress %s to %s\n", g_config.hdraw, g_config.hdpath);
+			return 0;
+		}
+	} else if(g_config.hdsize && g_config.hdstore && access(g_config.hdpath, F_OK) != 0){
+		if(vm_disk_dedup_create(g_config.hdpath, g_config.hdstore, (uint64_t)g_config.hdsize * 1024 * 1024 / VM_HDISK_SECTOR) < 0){
+			vm_fprintf(stderr, "can not create dedup image %s on %s\n", g_config.hdpath, g_config.hdstore);
+			return 0;
+		}
+	} else if(g_config.hdsize && access(g_config.hdpath, F_OK) != 0){
+		if(vm_disk_sparse_create(g_config.hdpath, (uint64_t)g_config.hdsize * 1024 * 1024 / VM_HDISK_SECTOR) < 0){
+			vm_fprintf(stderr, "can not create sparse image %s\n", g_config.hdpath);
+			return 0;
+		}
+	}
 
-	//只注册了primary通道的硬盘,目前只支持1块硬盘
-	pci_register_out_8(0x01f2, harddisk_sector_count);
-	pci_register_out_8(0x01f3, harddisk_store_lba_l);
-	pci_register_out_8(0x01f4, harddisk_store_lba_m);
-	pci_register_out_8(0x01f5, harddisk_store_lba_h);
-	pci_register_out_8(0x01f6, harddisk_store_lba_e);
-	pci_register_out_8(0x01f7, harddisk_command);
+	if(hd_open(g_hdisk, g_config.hdpath) < 0){
+		return 0;
+	}
 
-	pci_register_in_8(0x01f7, harddisk_status);
-	pci_register_in_8(0x01f0, harddisk_read_8); //读取命令执行结果
-	pci_register_in_16(0x01f0, harddisk_read_16);
+	//其余驱动器依次为primary从盘, secondary主盘, secondary从盘
+	for(i = 1; i < HDISK_DRIVES; i++){
+		if(g_config.hdextra[i - 1] && hd_open(hd_drive(i), g_config.hdextra[i - 1]) < 0){
+			return 0;
+		}
+	}
+
+	for(i = 0; i < 2; i++){
+		struct ide* ide = &g_ide[i];
+
+		pthread_mutex_init(&ide->mutex, NULL);
+		pthread_cond_init(&ide->cond, NULL);
+		ide->irq  = i == 0 ? 14 : 15;
+		ide->pending = 0;
+		ide->control = 0;
+		ide->pio_hd  = NULL;
+		ide->pio_state = IDE_PIO_NONE;
+		ide->reg.device = 0xa0;
+		ide->reg.status = IDE_STATUS_DRDY;
+		pthread_mutex_init(&ide->ra_mutex, NULL);
+		pthread_cond_init(&ide->ra_cond, NULL);
+
+		//没有驱动器的通道不注册端口, 读取时为浮空总线
+		if(ide->hd[0].disk == NULL && ide->hd[1].disk == NULL){
+			continue;
+		}
+
+		//每个通道独立的命令线程和预读线程, 两个通道的传输可以同时进行
+		pthread_create(&tid, NULL, &harddisk_task_command, ide);
+		pthread_create(&tid, NULL, &harddisk_task_readahead, ide);
+
+		uint16_t base = i == 0 ? 0x01f0 : 0x0170;
+		uint16_t control = i == 0 ? 0x03f6 : 0x0376;
+
+		pci_register_out_8(base + 2, harddisk_sector_count);
+		pci_register_out_8(base + 3, harddisk_store_lba_l);
+		pci_register_out_8(base + 4, harddisk_store_lba_m);
+		pci_register_out_8(base + 5, harddisk_store_lba_h);
+		pci_register_out_8(base + 6, harddisk_store_lba_e);
+		pci_register_out_8(base + 7, harddisk_command);
+		pci_register_out_8(control, harddisk_control);
+		pci_register_out_16(base, harddisk_write_16);
+
+		pci_register_in_8(base + 7, harddisk_status);
+		pci_register_in_8(control, harddisk_altstatus);
+		pci_register_in_8(base, harddisk_read_8); //读取命令执行结果
+		pci_register_read_16(base, harddisk_data_in_16, ide);
+	}
+
+	if(g_config.hdsync == VM_FILE_SYNC_PERIODIC && g_config.hdflushms){
+		pthread_create(&tid, NULL, &harddisk_task_flush, NULL);
+	}
+
+	return 1;
 }
 
 void harddisk_store_lba_l(uint16_t port, uint8_t lba){
-	pthread_mutex_lock(&g_mutex);  //防止命令执行过程中产生lba地址的改变
+	struct ide* ide = ide_channel(port);
 
-	g_ide_register.lba_low = lba;
-
-	pthread_mutex_unlock(&g_mutex);
+	pthread_mutex_lock(&ide->mutex);  //防止命令提交过程中产生lba地址的改变
+	ide->reg.lba_low = lba;
+	pthread_mutex_unlock(&ide->mutex);
 }
 
 void harddisk_store_lba_m(uint16_t port, uint8_t lba){
-	pthread_mutex_lock(&g_mutex);
-
-	g_ide_register.lba_middle = lba;
+	struct ide* ide = ide_channel(port);
 
-	pthread_mutex_unlock(&g_mutex);
+	pthread_mutex_lock(&ide->mutex);
+	ide->reg.lba_middle = lba;
+	pthread_mutex_unlock(&ide->mutex);
 }
 
 void harddisk_store_lba_h(uint16_t port, uint8_t lba){
-	pthread_mutex_lock(&g_mutex);
+	struct ide* ide = ide_channel(port);
 
-	g_ide_register.lba_high = lba;
-
-	pthread_mutex_unlock(&g_mutex);
+	pthread_mutex_lock(&ide->mutex);
+	ide->reg.lba_high = lba;
+	pthread_mutex_unlock(&ide->mutex);
 }
 
 void harddisk_store_lba_e(uint16_t port, uint8_t lba){
-	pthread_mutex_lock(&g_mutex);
-
-	g_ide_register.device &= 0x0f;
-   	g_ide_register.device |= (lba & 0x0f);
+	struct ide* ide = ide_channel(port);
 
-	pthread_mutex_unlock(&g_mutex);
+	pthread_mutex_lock(&ide->mutex);
+	ide->reg.device = lba;	//低4位为lba 24-27, 第4位选择主从盘
+	pthread_mutex_unlock(&ide->mutex);
 }
 
 void harddisk_sector_count(uint16_t port, uint8_t count){
-	pthread_mutex_lock(&g_mutex); //防止命令执行过程中发生count变化
+	struct ide* ide = ide_channel(port);
 
-	g_ide_register.sector_count = count;
-
-	pthread_mutex_unlock(&g_mutex);
+	pthread_mutex_lock(&ide->mutex);
+	ide->reg.sector_count = count;
+	pthread_mutex_unlock(&ide->mutex);
 }
 
 void harddisk_command(uint16_t port, uint8_t command){
-	pthread_mutex_lock(&g_mutex); //防止命令执行过程中发生寄存器变化
+	struct ide* ide = ide_channel(port);
+
+	pthread_mutex_lock(&ide->mutex);
 
-	g_ide_register.command = command;
+	struct hdisk* hd = hd_select(ide);
+	struct ide_request req;
 
-	pthread_mutex_unlock(&g_mutex);
+	ide->reg.command = command;
 
-	pthread_cond_signal(&g_cond); //通知有新命令进来
+	//命令执行中或者驱动器不存在时忽略
+	if((ide->reg.status & IDE_STATUS_BSY) || hd == NULL){
+		pthread_mutex_unlock(&ide->mutex);
+		return;
+	}
+
+	//未完成的数据传输被新命令终止
+	__atomic_store_n(&ide->pio_state, IDE_PIO_NONE, __ATOMIC_RELEASE);
+
+	req.command = command;
+	req.drive   = (ide->reg.device >> 4) & 1;
+	req.lba     = ((uint32_t)(ide->reg.device & 0x0f) << 24) | ((uint32_t)ide->reg.lba_high << 16) |
+				  ((uint32_t)ide->reg.lba_middle << 8) | ide->reg.lba_low;
+	req.count   = ide->reg.sector_count ? ide->reg.sector_count : 256;
+
+	switch(command){
+	case 0x20:	//读扇区
+	case 0x21:
+	case 0xec:	//硬盘识别
+	case 0xe7:	//写回缓存
+		ide_submit(ide, &req);
+		break;
+	case 0x30:	//写扇区, 先接收guest写入的数据, 写满后提交
+	case 0x31:
+		hd->data   = (uint64_t)req.count * VM_HDISK_SECTOR;
+		hd->pos    = 0;
+		hd_buffer(hd, hd->data);
+
+		ide->pio = req;
+		ide->pio_hd = hd;
+		__atomic_store_n(&ide->pio_state, IDE_PIO_OUT, __ATOMIC_RELEASE);
+		ide->reg.status = IDE_STATUS_DRDY | IDE_STATUS_DRQ;
+		break;
+	default:
+		fprintf(stderr, "do not support hd command 0x%02x\n", command);
+		ide_complete(ide, IDE_STATUS_DRDY | IDE_STATUS_ERR, IDE_ERROR_ABRT);
+		break;
+	}
+
+	pthread_mutex_unlock(&ide->mutex);
+}
+
+void harddisk_control(uint16_t port, uint8_t control){
+	struct ide* ide = ide_channel(port);
+
+	pthread_mutex_lock(&ide->mutex);
+
+	//软复位只清除状态, 执行中的命令继续执行
+	if((control & IDE_CONTROL_SRST) && !(ide->control & IDE_CONTROL_SRST)){
+		ide->reg.error = 0;
+		if(!(ide->reg.status & IDE_STATUS_BSY)){
+			ide->reg.status = IDE_STATUS_DRDY;
+		}
+	}
+
+	ide->control = control;
+
+	//屏蔽后撤销尚未响应的中断请求
+	if(control & IDE_CONTROL_NIEN){
+		interupt_lower(ide->irq);
+	}
+
+	pthread_mutex_unlock(&ide->mutex);
+}
+
+static void harddisk_status(uint16_t port){
+	struct ide* ide = ide_channel(port);
+
+	pthread_mutex_lock(&ide->mutex);
+
+	pci_setvalue_8(port, ide->reg.status);
+	interupt_lower(ide->irq);
+
+	pthread_mutex_unlock(&ide->mutex);
 }
 
-static void harddisk_status(void){
-	pci_setvalue_8(g_ide_register.status);
+static void harddisk_altstatus(uint16_t port){
+	struct ide* ide = ide_channel(port);
+
+	pci_setvalue_8(port, ide->reg.status);
 }
 
-static void harddisk_read_8(void){
-	pthread_mutex_lock(&g_mutex);
+/*
+ * 数据全部传输完成后把缓冲区交还命令线程并清除DRQ, 写命令此时提交
+ * 每次传输只在结束时加锁一次
+ */
+static void harddisk_data_done(struct ide* ide){
+	pthread_mutex_lock(&ide->mutex);
 
-	struct hdisk *hd = hd_select();
+	int state = ide->pio_state;
+	__atomic_store_n(&ide->pio_state, IDE_PIO_NONE, __ATOMIC_RELEASE);
+
+	if(state == IDE_PIO_OUT){
+		ide_submit(ide, &ide->pio);
+	} else {
+		ide->reg.status &= ~IDE_STATUS_DRQ;
+	}
 
+	pthread_mutex_unlock(&ide->mutex);
+}
+
+/*
+ * 数据端口不加锁: pio_state为IDE_PIO_IN/OUT时缓冲区和pos只由cpu线程访问
+ */
+static void harddisk_read_8(uint16_t port){
+	struct ide* ide = ide_channel(port);
 	uint8_t v = 0;
 
-	if(hd->pos < hd->data){
+	if(__atomic_load_n(&ide->pio_state, __ATOMIC_ACQUIRE) == IDE_PIO_IN){
+		struct hdisk *hd = ide->pio_hd;
+
 		v = hd->buffer[hd->pos++];
+		if(hd->pos >= hd->data){
+			harddisk_data_done(ide);
+		}
 	}
-	pci_setvalue_8(v);
 
-	pthread_mutex_unlock(&g_mutex);
+	pci_setvalue_8(port, v);
 }
 
-static void harddisk_read_16(void){
-	pthread_mutex_lock(&g_mutex);
+static uint16_t harddisk_data_in_16(void* arg){
+	struct ide* ide = (struct ide*)arg;
+	uint16_t v = 0;
 
-	struct hdisk *hd = hd_select();
+	if(__atomic_load_n(&ide->pio_state, __ATOMIC_ACQUIRE) == IDE_PIO_IN){
+		struct hdisk *hd = ide->pio_hd;
 
-	uint16_t v = 0;
+		if(hd->pos + 1 < hd->data){
+			memcpy(&v, hd->buffer + hd->pos, sizeof(v));
+		}
+		hd->pos += 2;
 
-	if(hd->pos < hd->data - 1){
-		v = *(uint16_t*)(&hd->buffer[hd->pos]);
+		if(hd->pos >= hd->data){
+			harddisk_data_done(ide);
+		}
 	}
-	hd->pos+=2;
-	pci_setvalue_16(v);
 
-	pthread_mutex_unlock(&g_mutex);
+	return v;
+}
+
+static void harddisk_write_16(uint16_t port, uint16_t v){
+	struct ide* ide = ide_channel(port);
+
+	if(__atomic_load_n(&ide->pio_state, __ATOMIC_ACQUIRE) == IDE_PIO_OUT){
+		struct hdisk *hd = ide->pio_hd;
+
+		if(hd->pos + 1 < hd->data){
+			memcpy(hd->buffer + hd->pos, &v, sizeof(v));
+		}
+		hd->pos += 2;
+
+		if(hd->pos >= hd->data){
+			harddisk_data_done(ide);
+		}
+	}
 }
 
 void bios_harddisk_reset(void){
 	;
 }
 
-uint8_t bios_harddisk_status(void){
-	return g_ide_register.status;
+/*
+ * bios驱动器号按存在的驱动器依次分配, 与pc bios相同, 引导盘总是0x80
+ */
+static struct hdisk* bios_drive(uint8_t drive){
+	int n = drive - 0x80;
+	int i = 0;
+
+	for(i = 0; i < HDISK_DRIVES && n >= 0; i++){
+		if(hd_drive(i)->disk && n-- == 0){
+			return hd_drive(i);
+		}
+	}
+
+	return NULL;
+}
+
+int bios_harddisk_count(void){
+	int count = 0;
+	int i = 0;
+
+	for(i = 0; i < HDISK_DRIVES; i++){
+		count += hd_drive(i)->disk != NULL;
+	}
+
+	return count;
 }
 
-void bios_harddisk_readsector(addr_t addr, uint32_t lba, uint32_t sector){
+uint8_t bios_harddisk_status(uint8_t drive){
+	struct hdisk* hd = bios_drive(drive);
+
+	return hd ? hd->ide->reg.status : 0;
+}
+
+/*
+ * 未启用缓存且映像已映射时扇区直接在映像和guest内存之间复制, 否则经缓冲区中转
+ * 成功返回0
+ */
+static int hd_bios_read(struct hdisk* hd, addr_t addr, uint64_t lba, uint32_t sector){
 	uint32_t bytes = sector * VM_HDISK_SECTOR;
 
-	if(bytes == 0) return;
+	if(bytes == 0) return 0;
 
-	uint8_t *buffer = (uint8_t*)malloc(bytes);
-	assert(buffer != NULL);
+	uint8_t* p = hd->cache ? NULL : vm_disk_addr(hd->disk, lba, sector);
+	if(p){
+		vm_write(addr, p, bytes);
+		hd_readahead(hd, lba, sector);
+		return 0;
+	}
 
-	struct vm_file_handle * handle = vm_file_handle_create();
-	assert(handle != NULL);
+	//大的扩展读按缓冲区大小分段, 对缓存和预读仍是一个连续的请求
+	uint32_t done = 0;
+	while(done < sector){
+		uint32_t n = sector - done;
+		if(n > sizeof(g_bounce) / VM_HDISK_SECTOR) n = sizeof(g_bounce) / VM_HDISK_SECTOR;
 
-	vm_file_handle_seek(handle, (uint64_t)lba * VM_HDISK_SECTOR);
-	vm_file_handle_read(handle, buffer, bytes);
+		if(hd_read(hd, lba + done, g_bounce, n) < 0){
+			return -1;
+		}
+		vm_write(addr + done * VM_HDISK_SECTOR, g_bounce, n * VM_HDISK_SECTOR);
+		done += n;
+	}
 
-	vm_write(addr, buffer, bytes);
+	hd_readahead(hd, lba, sector);
 
-	free(buffer);
-	vm_file_handle_destroy(handle);
+	return 0;
 }
 
-void bios_harddisk_writesector(addr_t addr, uint32_t lba, uint32_t sector){
+static int hd_bios_write(struct hdisk* hd, addr_t addr, uint64_t lba, uint32_t sector){
 	uint32_t bytes = sector * VM_HDISK_SECTOR;
 
-	if(bytes == 0) return;
+	if(bytes == 0) return 0;
 
-	uint8_t *buffer = (uint8_t*)malloc(bytes);
-	assert(buffer != NULL);
+	uint8_t* p = hd->cache ? NULL : vm_disk_addr(hd->disk, lba, sector);
+	if(p){
+		vm_read(addr, p, bytes);
+		return vm_disk_sync(hd->disk, lba, sector);
+	}
 
-	struct vm_file_handle * handle = vm_file_handle_create();
-	assert(handle != NULL);
+	uint32_t done = 0;
+	while(done < sector){
+		uint32_t n = sector - done;
+		if(n > sizeof(g_bounce) / VM_HDISK_SECTOR) n = sizeof(g_bounce) / VM_HDISK_SECTOR;
 
-	vm_file_handle_seek(handle, (uint64_t)lba * VM_HDISK_SECTOR);
+		vm_read(addr + done * VM_HDISK_SECTOR, g_bounce, n * VM_HDISK_SECTOR);
+		if(hd_write(hd, lba + done, g_bounce, n) < 0){
+			return -1;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+int bios_harddisk_readsector(uint8_t drive, addr_t addr, uint64_t lba, uint32_t sector){
+	struct hdisk* hd = bios_drive(drive);
+	uint64_t issued = hd_now_us();
+
+	if(hd == NULL) return -1;
+
+	int ret = hd_bios_read(hd, addr, lba, sector);
+	hd_account(hd, HDISK_OP_BIOS_READ, sector, ret, issued);
+
+	return ret;
+}
+
+int bios_harddisk_writesector(uint8_t drive, addr_t addr, uint64_t lba, uint32_t sector){
+	struct hdisk* hd = bios_drive(drive);
+	uint64_t issued = hd_now_us();
+
+	if(hd == NULL) return -1;
+
+	int ret = hd_bios_write(hd, addr, lba, sector);
+	hd_account(hd, HDISK_OP_BIOS_WRITE, sector, ret, issued);
+
+	return ret;
+}
+
+uint64_t bios_harddisk_sectors(uint8_t drive){
+	struct hdisk* hd = bios_drive(drive);
 
-	vm_read(addr, buffer, bytes);
+	return hd ? hd->disk->sectors : 0;
+}
 
-	vm_file_handle_write(handle, buffer, bytes);
+uint32_t bios_harddisk_cylinders(uint8_t drive){
+	struct hdisk* hd = bios_drive(drive);
 
-	free(buffer);
-	vm_file_handle_destroy(handle);
+	return hd ? hd->cylinders : 0;
 }
 
+int harddisk_flush(void){
+	int ret = 0;
+	int i = 0;
+
+	if(g_hdisk == NULL){
+		return 0;
+	}
+
+	for(i = 0; i < HDISK_DRIVES; i++){
+		if(hd_drive(i)->disk && hd_flush(hd_drive(i)) < 0){
+			ret = -1;
+		}
+	}
 
-static struct hdisk * hd_select(void){
-	return g_hdisk;
+	return ret;
 }
 
-static uint32_t hd_lba(void){
-	uint32_t lba;
+/*
+ * VM_FILE_SYNC_PERIODIC: 定期把所有驱动器的脏数据写回并落盘
+ */
+void* harddisk_task_flush(void* arg){
+	while(1){
+		usleep(g_config.hdflushms * 1000);
+		harddisk_flush();
+	}
+
+	return NULL;
+}
+
+int harddisk_cache_stats(struct vm_cache_stats* stats){
+	struct vm_cache_stats one;
+	int found = 0;
+	int i = 0;
+
+	if(g_hdisk == NULL){
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+
+	for(i = 0; i < HDISK_DRIVES; i++){
+		if(hd_drive(i)->cache == NULL){
+			continue;
+		}
+
+		vm_cache_stats_get(hd_drive(i)->cache, &one);
+		stats->hits          += one.hits;
+		stats->misses        += one.misses;
+		stats->evictions     += one.evictions;
+		stats->writebacks    += one.writebacks;
+		stats->batches       += one.batches;
+		stats->prefetched    += one.prefetched;
+		stats->prefetch_hits += one.prefetch_hits;
+		stats->dirty         += one.dirty;
+		found = 1;
+	}
+
+	return found ? 0 : -1;
+}
+
+static uint64_t hd_now_us(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void hd_account(struct hdisk* hd, int op, uint32_t sectors, int ret, uint64_t issued){
+	struct hdisk_op_stats* st = &hd->stats.op[op];
+	uint64_t us = hd_now_us() - issued;
+	int bucket = 0;
+
+	while(bucket < HDISK_LAT_BUCKETS - 1 && (us >> (bucket + 1)) != 0){
+		bucket++;
+	}
+
+	__atomic_fetch_add(&st->commands, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->latency_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->hist[bucket], 1, __ATOMIC_RELAXED);
+	if(ret < 0){
+		__atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&st->sectors, sectors, __ATOMIC_RELAXED);
+	}
+}
+
+int harddisk_io_stats(int drive, struct hdisk_stats* stats){
+	uint64_t* src = NULL;
+	uint64_t* dst = (uint64_t*)stats;
+	size_t i = 0;
+
+	if(g_hdisk == NULL || drive < 0 || drive >= HDISK_DRIVES || hd_drive(drive)->disk == NULL){
+		return -1;
+	}
+
+	//各计数器单独原子读取, 快照内的计数器之间可能相差正在进行的请求
+	src = (uint64_t*)&hd_drive(drive)->stats;
+	for(; i < sizeof(*stats) / sizeof(uint64_t); i++){
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+const char* harddisk_op_name(int op){
+	static const char* names[HDISK_OP_COUNT] = {
+		"read", "write", "identify", "flush", "bios read", "bios write"
+	};
+
+	return op >= 0 && op < HDISK_OP_COUNT ? names[op] : "unknown";
+}
+
+uint64_t harddisk_op_percentile(const struct hdisk_op_stats* stats, int p){
+	uint64_t target = (stats->commands * p + 99) / 100;
+	uint64_t seen = 0;
+	int i = 0;
+
+	for(; i < HDISK_LAT_BUCKETS; i++){
+		seen += stats->hist[i];
+		if(seen >= target && seen > 0){
+			return (uint64_t)1 << (i + 1);
+		}
+	}
+
+	return (uint64_t)1 << HDISK_LAT_BUCKETS;
+}
+
+int harddisk_load(void* buffer, uint32_t size){
+	struct vm_disk* disk = g_hdisk->disk;
+	uint32_t sector = size / VM_HDISK_SECTOR;
+
+	if(sector > disk->sectors){
+		sector = disk->sectors;
+	}
+
+	if(vm_disk_read(disk, 0, (uint8_t*)buffer, sector) < 0){
+		return -1;
+	}
+
+	return sector * VM_HDISK_SECTOR;
+}
+
+static int hd_flush(struct hdisk* hd){
+	if(hd->cache && vm_cache_flush(hd->cache) < 0){
+		return -1;
+	}
+
+	return vm_disk_flush(hd->disk);
+}
+
+static uint8_t* hd_buffer(struct hdisk* hd, uint64_t bytes){
+	if(bytes > hd->size){
+		hd->buffer = (uint8_t*)realloc(hd->buffer, bytes);
+		assert(hd->buffer != NULL);
+		hd->size = bytes;
+	}
+
+	return hd->buffer;
+}
+
+static int hd_read(struct hdisk* hd, uint64_t lba, uint8_t* buffer, uint32_t count){
+	if(hd->cache){
+		return vm_cache_read(hd->cache, lba, buffer, count);
+	}
+
+	return vm_disk_read(hd->disk, lba, buffer, count);
+}
+
+static int hd_write(struct hdisk* hd, uint64_t lba, const uint8_t* buffer, uint32_t count){
+	//压缩映像只读, 不能让写入停留在缓存中
+	if(hd->disk->type == VM_DISK_COMPRESSED){
+		return -1;
+	}
+
+	if(hd->cache){
+		return vm_cache_write(hd->cache, lba, buffer, count);
+	}
+
+	return vm_disk_write(hd->disk, lba, buffer, count);
+}
+
+static struct ide* ide_channel(uint16_t port){
+	return (port & 0xfff8) == 0x0170 || port == 0x0376 ? &g_ide[1] : &g_ide[0];
+}
 
-	struct  hdisk* hd = hd_select();
-	assert(hd != NULL);
+static struct hdisk * hd_select(struct ide* ide){
+	struct hdisk* hd = &ide->hd[(ide->reg.device >> 4) & 1];
 
-	return hd->pos / VM_HDISK_SECTOR;
+	return hd->disk ? hd : NULL;
 }
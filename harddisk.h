@@ -6,44 +6,84 @@
 #define VM_HDISK_SECTOR 512 //固定扇区大小为512
 
 #define HDISK_H   4   //磁头数
-#define HDISK_S   64  //每磁道扇区数
-#define HDISK_M   480 //柱面数
+#define HDISK_S   63  //每磁道扇区数, int 13h的CL只有6位扇区号
 
 #include <stdint.h>
+#include <pthread.h>
+#include "util/util_file.h"
+#include "util/util_cache.h"
+
+/*
+ * 顺序读检测, 连续的请求以相同步长前进时预读其后的扇区
+ */
+struct hdisk_ra{
+	uint64_t last;		//上一次读请求的起始lba
+	uint64_t end;		//上一次读请求的结束lba
+	uint64_t issued;	//已经提交预读的结束lba
+	uint32_t stride;	//上一次观察到的步长
+	uint32_t depth;		//预读深度(步长的倍数), 0表示未检测到顺序流
+	uint64_t lba;		//等待预读线程执行的请求
+	uint32_t count;		//0表示没有请求
+};
+
+/*
+ * 每块盘的I/O统计, 各线程以原子操作累加, 不加锁
+ * ATA命令的延迟从提交到命令线程开始计算, 到DRQ置位(读)或者命令完成(写, 刷新)为止
+ * 直方图第i个桶统计[2^i, 2^(i+1))微秒的请求, 第0个桶包括1微秒以下
+ */
+#define HDISK_OP_READ		0	//ATA读扇区
+#define HDISK_OP_WRITE		1	//ATA写扇区
+#define HDISK_OP_IDENTIFY	2	//ATA识别
+#define HDISK_OP_FLUSH		3	//ATA刷新缓存
+#define HDISK_OP_BIOS_READ	4	//int 13h读
+#define HDISK_OP_BIOS_WRITE	5	//int 13h写
+#define HDISK_OP_COUNT		6
+
+#define HDISK_LAT_BUCKETS	24	//最后一个桶包括8秒以上
+
+struct hdisk_op_stats{
+	uint64_t commands;
+	uint64_t sectors;
+	uint64_t errors;
+	uint64_t latency_us;	//总延迟, 用于计算平均值
+	uint64_t hist[HDISK_LAT_BUCKETS];
+};
+
+struct hdisk_stats{
+	struct hdisk_op_stats op[HDISK_OP_COUNT];
+};
+
+struct ide;
 
 /*
  * 表示单块硬盘
  */
 struct hdisk{ 
-	uint8_t *buffer;    //读取的数据缓冲区
+	uint8_t *buffer;    //数据端口的传输缓冲区, 按需分配
+	uint64_t size;		//缓冲区容量
 	uint64_t data;		//当前数据的长度
 	uint64_t pos;		//表示当前读取sector的位置
+	struct vm_disk *disk; //磁盘映像的I/O上下文
+	struct vm_cache *cache; //扇区缓存, 未启用时为NULL
+	struct hdisk_ra ra;	//预读状态
+	uint32_t cylinders;	//柱面数, 由映像大小计算
+	struct ide *ide;	//所在的通道
+	struct hdisk_stats stats;
 };
 
 #define VM_HDISK_IDE_PRIMARY   0
 #define VM_HDISK_IDE_SECONDARY 1
 
-/*
- * ide通道
- */
-struct ide{
-	struct hdisk hd[2]; //hd[0]为主盘 hd[1]为从盘
-};
-
-//一般存在2个ide通道
-extern struct ide g_ide[2];
-
 struct ide_register{
-	uint8_t device; //device寄存器
+	uint8_t device; //device寄存器, 低4位存储lba地址的24-27位
+					//第4位主(0)从(1)盘,
+					//第5,7位固定式1,
+					//第6位LBA开关(LBA->1, CHS->0)
 	uint8_t error;	//读时是error寄存器，写时是feature寄存器
 	uint8_t sector_count; //sector count寄存器,用于指定待读写扇区的数量
 	uint8_t lba_low;	//lba地址0-7
 	uint8_t lba_middle; //lba地址8-15
 	uint8_t lba_high;	//lba地址16-23
-	uint8_t dev;		//低4位存储lba地址的24-27位
-						//第4位主(0)从(1)盘,
-						//第5,7位固定式1,
-						//第6位LBA开关(LBA->1, CHS->0)
 	uint8_t status; //状态寄存器, 只关心0,3,6,7位
 					//0位为err位,值为1表示出错,具体原因见error寄存器
 					//3位为data request位, 1表示数据已备好
@@ -52,14 +92,79 @@ struct ide_register{
 	uint8_t command; //command寄存器
 };
 
-extern struct ide_register g_ide_register;
+#define IDE_STATUS_ERR		0x01
+#define IDE_STATUS_DRQ		0x08
+#define IDE_STATUS_DRDY		0x40
+#define IDE_STATUS_BSY		0x80
+
+#define IDE_ERROR_ABRT		0x04	//命令被终止
+
+#define IDE_CONTROL_NIEN	0x02	//设备控制寄存器, 屏蔽中断
+#define IDE_CONTROL_SRST	0x04	//设备控制寄存器, 软复位
+
+//数据缓冲区的所有权, 在命令线程和cpu线程之间传递
+#define IDE_PIO_NONE		0		//归命令线程所有, 数据端口无数据
+#define IDE_PIO_IN			1		//归cpu线程所有, guest读取数据
+#define IDE_PIO_OUT			2		//归cpu线程所有, guest写入数据
+
+/*
+ * 提交到通道命令线程的命令, 寄存器的值在提交时确定
+ */
+struct ide_request{
+	uint8_t command;
+	uint8_t drive;		//0主盘 1从盘
+	uint32_t lba;
+	uint32_t count;		//扇区数
+	uint64_t issued;	//提交时间(微秒), 用于统计延迟
+};
+
+/*
+ * ide通道
+ * 端口访问只持有本通道的锁, 命令由通道的命令线程异步执行, 完成后更新状态并发出中断
+ */
+struct ide{
+	struct hdisk hd[2]; //hd[0]为主盘 hd[1]为从盘
+	struct ide_register reg;
+	uint8_t control;	//设备控制寄存器
+	uint8_t irq;		//primary为IRQ14, secondary为IRQ15
+	struct ide_request req;	//提交给命令线程的命令, BSY期间不接受新命令
+	int pending;			//req尚未被命令线程执行完
+	struct ide_request pio; //正在接收guest数据的写命令
+	struct hdisk* pio_hd;	//正在传输数据的磁盘
+	int pio_state;			//IDE_PIO_*, 原子访问
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_mutex_t ra_mutex;	//两块盘的预读请求
+	pthread_cond_t ra_cond;
+};
+
+//一般存在2个ide通道, 共4个驱动器
+extern struct ide g_ide[2];
+#define HDISK_DRIVES 4
 
-void harddisk_init(void);
+int harddisk_init(void);
 
-//提供给bios 0x13中断的接口函数
+//提供给bios 0x13中断的接口函数, drive为dl(0x80起), 按存在的驱动器依次编号
 void bios_harddisk_reset(void); 	//重置磁盘
-uint8_t bios_harddisk_status(void); //获取磁盘状态
-void bios_harddisk_readsector(addr_t addr, uint32_t lba, uint32_t sector); //读取sector个扇区数据到addr地址空间处
-void bios_harddisk_writesector(addr_t addr, uint32_t lba, uint32_t sector); //写入sector个扇区数据到addr地址空间处
+uint8_t bios_harddisk_status(uint8_t drive); //获取磁盘状态
+int bios_harddisk_count(void);		//存在的驱动器数
+int bios_harddisk_readsector(uint8_t drive, addr_t addr, uint64_t lba, uint32_t sector); //读取sector个扇区数据到addr地址空间处
+int bios_harddisk_writesector(uint8_t drive, addr_t addr, uint64_t lba, uint32_t sector); //写入sector个扇区数据到addr地址空间处
+uint64_t bios_harddisk_sectors(uint8_t drive);	//磁盘扇区数, 驱动器不存在时为0
+uint32_t bios_harddisk_cylinders(uint8_t drive);	//柱面数, 磁头数和每磁道扇区数固定为HDISK_H, HDISK_S
+
+//从主盘起始处读取size字节用于引导, 返回读取的字节数
+int harddisk_load(void* buffer, uint32_t size);
+
+//写回所有驱动器扇区缓存中的脏数据, 关机或挂起时调用
+int harddisk_flush(void);
+//获取所有驱动器扇区缓存的统计之和, 未启用缓存时返回-1
+int harddisk_cache_stats(struct vm_cache_stats* stats);
+//获取驱动器(0为primary主盘, 3为secondary从盘)的I/O统计快照, 驱动器不存在时返回-1
+int harddisk_io_stats(int drive, struct hdisk_stats* stats);
+//统计中的名称, 例如"read"
+const char* harddisk_op_name(int op);
+//按直方图估计第p(0-100)百分位的延迟(微秒), 取桶的上界
+uint64_t harddisk_op_percentile(const struct hdisk_op_stats* stats, int p);
 
 #endif
@@ -0,0 +1,43 @@
+#include "interupt.h"
+
+int interupt_init(void){
+#ifdef INTR_8259A
+	return pic8259a_init();
+#endif
+}
+
+void interupt_raise(uint8_t irq){
+#ifdef INTR_8259A
+	pic8259a_raise(irq);
+#endif
+}
+
+void interupt_lower(uint8_t irq){
+#ifdef INTR_8259A
+	pic8259a_lower(irq);
+#endif
+}
+
+int interupt_pending(void){
+#ifdef INTR_8259A
+	return pic8259a_pending();
+#endif
+}
+
+int interupt_ack(void){
+#ifdef INTR_8259A
+	return pic8259a_ack();
+#endif
+}
+
+void interupt_eoi(uint8_t irq){
+#ifdef INTR_8259A
+	pic8259a_eoi(irq);
+#endif
+}
+
+int interupt_wait(uint32_t timeout_ms){
+#ifdef INTR_8259A
+	return pic8259a_wait(timeout_ms);
+#endif
+}
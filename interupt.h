@@ -0,0 +1,28 @@
+#ifndef VM_INTERUPT_H
+#define VM_INTERUPT_H
+
+#include <stdint.h>
+
+#ifdef INTR_8259A
+	#include "8259A/8259A.h"
+#else
+	#error "Interupt controller can not be NULL"
+#endif
+
+//初始化中断控制器, 需在pci之后初始化
+int interupt_init(void);
+
+//设备提出或撤销中断请求
+void interupt_raise(uint8_t irq);
+void interupt_lower(uint8_t irq);
+
+//是否有待处理的中断
+int interupt_pending(void);
+//cpu响应中断, 返回中断向量号, 没有中断时返回-1
+int interupt_ack(void);
+//中断服务结束
+void interupt_eoi(uint8_t irq);
+//等待中断, 超时返回0
+int interupt_wait(uint32_t timeout_ms);
+
+#endif
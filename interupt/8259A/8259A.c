@@ -1,3 +1,254 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
 #include "8259A/8259A.h"
+#include "8086/pci.h"
+
+struct pic8259a{
+	uint8_t line;	//设备中断请求线的电平
+	uint8_t irr;	//中断请求寄存器
+	uint8_t isr;	//服务中寄存器
+	uint8_t imr;	//中断屏蔽寄存器
+	uint8_t base;	//中断向量基址
+	uint8_t step;	//初始化命令字的序号, 0表示初始化完成
+	uint8_t icw4;	//初始化时需要ICW4
+	uint8_t risr;	//OCW3选择读取ISR
+};
+
+static struct pic8259a g_pic[2];	//0主片 1从片
+
+/*
+ * 设备线程提出请求, cpu线程响应, 都在锁内修改寄存器
+ * g_pic_pending在每次修改后重新计算, cpu每条指令前只读取它
+ */
+static pthread_mutex_t g_pic_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pic_cond = PTHREAD_COND_INITIALIZER;
+static volatile int g_pic_pending = 0;
+
+//返回优先级最高的待处理请求(编号最小), 被同级或更高级的服务中中断挡住时返回-1
+static int pic_highest(struct pic8259a* pic){
+	uint8_t req = pic->irr & ~pic->imr;
+	int i = 0;
+
+	for(; i < 8; i++){
+		if(pic->isr & (1 << i)){
+			return -1;
+		}
+		if(req & (1 << i)){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+//从片的请求反映到主片的级联引脚
+static void pic_update(void){
+	if(pic_highest(&g_pic[1]) >= 0){
+		g_pic[0].irr |= (1 << PIC8259A_CASCADE);
+	} else {
+		g_pic[0].irr &= ~(1 << PIC8259A_CASCADE);
+	}
+
+	g_pic_pending = pic_highest(&g_pic[0]) >= 0;
+
+	if(g_pic_pending){
+		pthread_cond_broadcast(&g_pic_cond);
+	}
+}
+
+void pic8259a_raise(uint8_t irq){
+	pthread_mutex_lock(&g_pic_mutex);
+
+	struct pic8259a* pic = &g_pic[irq >> 3];
+	uint8_t bit = 1 << (irq & 7);
+
+	//与pc相同为边沿触发, 请求线由低变高时锁存到irr
+	if(!(pic->line & bit)){
+		pic->line |= bit;
+		pic->irr  |= bit;
+		pic_update();
+	}
+
+	pthread_mutex_unlock(&g_pic_mutex);
+}
+
+void pic8259a_lower(uint8_t irq){
+	pthread_mutex_lock(&g_pic_mutex);
+
+	g_pic[irq >> 3].line &= ~(1 << (irq & 7));
+
+	pthread_mutex_unlock(&g_pic_mutex);
+}
+
+int pic8259a_pending(void){
+	return g_pic_pending;
+}
+
+int pic8259a_ack(void){
+	int vector = -1;
+
+	pthread_mutex_lock(&g_pic_mutex);
+
+	int irq = pic_highest(&g_pic[0]);
+	if(irq >= 0){
+		g_pic[0].irr &= ~(1 << irq);
+		g_pic[0].isr |= (1 << irq);
+		vector = g_pic[0].base + irq;
+
+		if(irq == PIC8259A_CASCADE){
+			int sirq = pic_highest(&g_pic[1]);
+			g_pic[1].irr &= ~(1 << sirq);
+			g_pic[1].isr |= (1 << sirq);
+			vector = g_pic[1].base + sirq;
+		}
+	}
+
+	pic_update();
+
+	pthread_mutex_unlock(&g_pic_mutex);
+
+	return vector;
+}
+
+static void pic_eoi(struct pic8259a* pic, int irq){
+	if(irq < 0){
+		//非特定EOI, 清除优先级最高的ISR位
+		for(irq = 0; irq < 8 && !(pic->isr & (1 << irq)); irq++){
+			;
+		}
+	}
+
+	if(irq < 8){
+		pic->isr &= ~(1 << irq);
+	}
+}
+
+void pic8259a_eoi(uint8_t irq){
+	pthread_mutex_lock(&g_pic_mutex);
+
+	if(irq >= 8){
+		pic_eoi(&g_pic[1], irq & 7);
+		irq = PIC8259A_CASCADE;
+	}
+	pic_eoi(&g_pic[0], irq);
+
+	pic_update();
+
+	pthread_mutex_unlock(&g_pic_mutex);
+}
+
+int pic8259a_wait(uint32_t timeout_ms){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec  += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000){
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&g_pic_mutex);
+
+	while(!g_pic_pending){
+		if(pthread_cond_timedwait(&g_pic_cond, &g_pic_mutex, &ts) == ETIMEDOUT){
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&g_pic_mutex);
+
+	return g_pic_pending;
+}
+
+/*
+ * 命令端口: ICW1, OCW2(EOI), OCW3(选择读取IRR/ISR)
+ */
+static void pic_out_command(uint16_t port, uint8_t v){
+	struct pic8259a* pic = &g_pic[port == 0xa0];
+
+	pthread_mutex_lock(&g_pic_mutex);
+
+	if(v & 0x10){			//ICW1
+		pic->imr  = 0;
+		pic->isr  = 0;
+		pic->step = 2;
+		pic->icw4 = v & 0x01;
+		pic->risr = 0;
+	} else if(v & 0x08){	//OCW3
+		if(v & 0x02){
+			pic->risr = v & 0x01;
+		}
+	} else if(v & 0x20){	//OCW2 EOI, 0x60为特定EOI
+		pic_eoi(pic, (v & 0x40) ? (v & 0x07) : -1);
+	}
+
+	pic_update();
+
+	pthread_mutex_unlock(&g_pic_mutex);
+}
+
+/*
+ * 数据端口: 初始化时依次为ICW2-ICW4, 之后为OCW1(IMR)
+ */
+static void pic_out_data(uint16_t port, uint8_t v){
+	struct pic8259a* pic = &g_pic[port == 0xa1];
+
+	pthread_mutex_lock(&g_pic_mutex);
+
+	switch(pic->step){
+	case 2:		//ICW2 中断向量基址
+		pic->base = v & 0xf8;
+		pic->step = 3;
+		break;
+	case 3:		//ICW3 级联, 固定为主从各一片
+		pic->step = pic->icw4 ? 4 : 0;
+		break;
+	case 4:		//ICW4 只支持8086模式
+		pic->step = 0;
+		break;
+	default:	//OCW1
+		pic->imr = v;
+		break;
+	}
+
+	pic_update();
+
+	pthread_mutex_unlock(&g_pic_mutex);
+}
+
+static void pic_in_command(uint16_t port){
+	struct pic8259a* pic = &g_pic[port == 0xa0];
+
+	pci_setvalue_8(port, pic->risr ? pic->isr : pic->irr);
+}
+
+static void pic_in_data(uint16_t port){
+	struct pic8259a* pic = &g_pic[port == 0xa1];
+
+	pci_setvalue_8(port, pic->imr);
+}
+
+int pic8259a_init(void){
+	memset(g_pic, 0, sizeof(g_pic));
+
+	//与pc bios初始化后的状态一致
+	g_pic[0].base = PIC8259A_MASTER_BASE;
+	g_pic[1].base = PIC8259A_SLAVE_BASE;
+
+	pci_register_out_8(0x20, pic_out_command);
+	pci_register_out_8(0x21, pic_out_data);
+	pci_register_out_8(0xa0, pic_out_command);
+	pci_register_out_8(0xa1, pic_out_data);
+
+	pci_register_in_8(0x20, pic_in_command);
+	pci_register_in_8(0x21, pic_in_data);
+	pci_register_in_8(0xa0, pic_in_command);
+	pci_register_in_8(0xa1, pic_in_data);
 
-//XXX
+	return 1;
+}
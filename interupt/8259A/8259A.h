@@ -1,6 +1,34 @@
 #ifndef VM_8259A_H
 #define VM_8259A_H
 
-//XXX
+#include <stdint.h>
+
+/*
+ * 主从两片级联的8259A, 从片接在主片的IRQ2上
+ * 主片端口0x20/0x21, 从片端口0xa0/0xa1, 默认中断向量基址分别为0x08和0x70
+ */
+#define PIC8259A_IRQS			16
+#define PIC8259A_CASCADE		2		//从片所接的主片引脚
+
+#define PIC8259A_MASTER_BASE	0x08
+#define PIC8259A_SLAVE_BASE		0x70
+
+int pic8259a_init(void);
+
+//设备设置或清除中断请求线
+void pic8259a_raise(uint8_t irq);
+void pic8259a_lower(uint8_t irq);
+
+//是否有可以交给cpu的中断, 供cpu每条指令前检查
+int pic8259a_pending(void);
+
+//cpu响应中断, 返回中断向量号, 没有中断时返回-1
+int pic8259a_ack(void);
+
+//结束中断, 清除irq的ISR位
+void pic8259a_eoi(uint8_t irq);
+
+//等待中断请求, 最多等待timeout_ms毫秒, 有中断时返回1
+int pic8259a_wait(uint32_t timeout_ms);
 
 #endif
@@ -1,12 +1,19 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <assert.h>
 #include "config.h" //包含基本的宏定义，需要放在头文件的开始处
 #include "cpu.h"
 #include "vgui.h"
+#include "vgio.h"
 #include "mem.h"
 #include "keyboard.h"
+#include "harddisk.h"
 #include "util/util_file.h"
-//#include "interupt.h"
+#include "interupt.h"
 
 extern char *optarg;
 
@@ -19,20 +26,27 @@ static void init_resource(void){
 
 	vm_fprintf(stdout,"init virtual memory ...\n");
 	assert(mem_init() != 0); 		//内存初始化
+	if(g_config.mempath){
+		assert(mem_base_map(g_config.mempath) == 0); //映射公共内存映像
+	}
 	vm_fprintf(stdout,"init virtual memory done\n");
 
+	vm_fprintf(stdout,"init bios rom ...\n");
+	assert(cpu_bios_init(g_config.biospath) != 0); 	//bios映像及中断向量表初始化
+	vm_fprintf(stdout,"init bios rom done\n");
+
 	vm_fprintf(stdout, "init virtual grouph IO interface ...\n");
 	assert(vgui_init() != 0); 		//vgio初始化
 	vm_fprintf(stdout, "init virtual grouph IO interface done\n");
 
-	//vm_fprintf(stdout, "init interupt ...\n");
-	//assert(interupt_init() != 0);	//中断处理器初始化
-	//vm_fprintf(stdout, "init interupt done\n");
-
 	vm_fprintf(stdout, "init pci device ...\n");
 	assert(pci_init() != 0);	//keyboard初始化
 	vm_fprintf(stdout, "init pcievice done\n");
 
+	vm_fprintf(stdout, "init interupt ...\n");
+	assert(interupt_init() != 0);	//中断处理器初始化, 需要注册pci端口
+	vm_fprintf(stdout, "init interupt done\n");
+
 	vm_fprintf(stdout, "init keyboard device ...\n");
 	assert(keyboard_init() != 0);	//keyboard初始化
 	vm_fprintf(stdout, "init keyboard device done\n");
@@ -42,26 +56,215 @@ static void init_resource(void){
 	vm_fprintf(stdout, "init harddisk done\n");
 }
 
+/*
+ * 收到SIGUSR1时挂起guest并压缩其内存, 再次收到时恢复
+ * 收到SIGINT/SIGTERM时正常退出, 由atexit写回磁盘缓存
+ */
+static void* thread_park(void* arg){
+	sigset_t* set = (sigset_t*)arg;
+	struct vm_park_stats stats;
+	int parked = 0;
+	int sig = 0;
+
+	while(sigwait(set, &sig) == 0){
+		//关机前写回磁盘缓存
+		if(sig != SIGUSR1){
+			if(!parked) cpu_suspend();
+			exit(0);
+		}
+
+		if(!parked){
+			cpu_suspend();
+			harddisk_flush();
+			mem_park();
+
+			mem_park_stats(&stats);
+			vm_fprintf(stdout, "park %u pages (%u zero), %llu -> %llu bytes, ratio %.2f\n",
+					stats.pages, stats.zero_pages,
+					(unsigned long long)stats.raw_bytes, (unsigned long long)stats.packed_bytes,
+					stats.packed_bytes ? (double)stats.raw_bytes / stats.packed_bytes : 0.0);
+		} else {
+			mem_unpark();
+			cpu_resume();
+
+			mem_park_stats(&stats);
+			vm_fprintf(stdout, "resume %llu us, %u pages restored\n",
+					(unsigned long long)stats.resume_ns / 1000, stats.pages);
+		}
+
+		parked = !parked;
+	}
+
+	return NULL;
+}
+
+static void print_disk_stats(void){
+	struct vm_cache_stats stats;
+
+	if(harddisk_cache_stats(&stats) < 0){
+		return;
+	}
+
+	vm_fprintf(stdout, "harddisk cache: %llu hits, %llu misses, %llu evictions, %llu writebacks in %llu batches, %llu/%llu prefetched blocks used\n",
+			(unsigned long long)stats.hits, (unsigned long long)stats.misses,
+			(unsigned long long)stats.evictions, (unsigned long long)stats.writebacks, (unsigned long long)stats.batches,
+			(unsigned long long)stats.prefetch_hits, (unsigned long long)stats.prefetched);
+}
+
+static void print_io_stats(void){
+	struct hdisk_stats stats;
+	int drive = 0;
+	int op = 0;
+
+	for(drive = 0; drive < HDISK_DRIVES; drive++){
+		if(harddisk_io_stats(drive, &stats) < 0){
+			continue;
+		}
+
+		for(op = 0; op < HDISK_OP_COUNT; op++){
+			struct hdisk_op_stats* st = &stats.op[op];
+
+			if(st->commands == 0){
+				continue;
+			}
+
+			vm_fprintf(stdout, "harddisk %d %s: %llu commands, %llu sectors, %llu errors, avg %llu us, p50 <%llu us, p99 <%llu us\n",
+					drive, harddisk_op_name(op), (unsigned long long)st->commands,
+					(unsigned long long)st->sectors, (unsigned long long)st->errors,
+					(unsigned long long)(st->latency_us / st->commands),
+					(unsigned long long)harddisk_op_percentile(st, 50),
+					(unsigned long long)harddisk_op_percentile(st, 99));
+		}
+	}
+}
+
+static void print_vgui_stats(void){
+	uint64_t commands = 0, writes = 0;
+
+	vgui_stats(&commands, &writes);
+	if(commands == 0){
+		return;
+	}
+
+	vm_fprintf(stdout, "vgio: %llu commands in %llu writes\n",
+			(unsigned long long)commands, (unsigned long long)writes);
+}
+
+static void shutdown_resource(void){
+	harddisk_flush();
+	print_disk_stats();
+	print_io_stats();
+	print_vgui_stats();
+	//cpu线程在退出前仍可能写入文本缓冲区, 只标记删除不解除映射
+	vgio_shm_remove();
+}
+
 static void print_usage(char* progname){
-	vm_fprintf(stdout, "%s hardiskpath\n", progname);
+	vm_fprintf(stdout, "%s [-r biosrom] [-m memimage] [-M savememimage] [-y none|async|sync|flush|periodic[:ms]] [-c cachemb] [-b baseimage] [-s sizemb [-D chunkstore]] [-z rawimage] [-l bootsectors] [-d extradisk]... hardiskpath\n", progname);
+	vm_fprintf(stdout, "  -y  async(default) and sync write through the disk cache; none, flush and periodic keep dirty blocks and coalesce their write-back with pwritev\n");
 }
 
 int main(int argc, char* argv[]){
-	if(argc != 2){
+	int opt = 0;
+	uint32_t ndisk = 0;
+
+	g_config.hdsync = VM_FILE_SYNC_ASYNC;
+	g_config.hdcache = 8;
+	g_config.hdflushms = 1000;
+	g_config.bootsectors = 1;
+
+	while((opt = getopt(argc, argv, "r:m:M:y:c:b:s:D:z:l:d:")) != -1){
+		switch(opt){
+		case 'r':
+			g_config.biospath = optarg;
+			break;
+		case 'm':
+			g_config.mempath = optarg;
+			break;
+		case 'M':
+			g_config.memsave = optarg;
+			break;
+		case 'y':
+			if(strcmp(optarg, "none") == 0 || strcmp(optarg, "unsafe") == 0){
+				g_config.hdsync = VM_FILE_SYNC_NONE;
+			} else if(strcmp(optarg, "sync") == 0){
+				g_config.hdsync = VM_FILE_SYNC_SYNC;
+			} else if(strcmp(optarg, "flush") == 0){
+				g_config.hdsync = VM_FILE_SYNC_FLUSH;
+			} else if(strncmp(optarg, "periodic", 8) == 0){
+				g_config.hdsync = VM_FILE_SYNC_PERIODIC;
+				if(optarg[8] == ':'){
+					g_config.hdflushms = (uint32_t)strtoul(optarg + 9, NULL, 10);
+				}
+			} else {
+				g_config.hdsync = VM_FILE_SYNC_ASYNC;
+			}
+			break;
+		case 'c':
+			g_config.hdcache = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			g_config.hdbase = optarg;
+			break;
+		case 's':
+			g_config.hdsize = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			g_config.hdstore = optarg;
+			break;
+		case 'z':
+			g_config.hdraw = optarg;
+			break;
+		case 'l':
+			g_config.bootsectors = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			//最多再挂3块盘
+			if(ndisk >= sizeof(g_config.hdextra) / sizeof(g_config.hdextra[0])){
+				print_usage(argv[0]);
+				exit(-1);
+			}
+			g_config.hdextra[ndisk++] = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(-1);
+		}
+	}
+
+	if(optind + 1 != argc){
 		print_usage(argv[0]);
 		exit(-1);
 	}
 
-	init_resource();
+	g_config.hdpath = argv[optind];
 
-	g_config.hdpath = argv[1];
+	//SIGUSR1/SIGINT/SIGTERM由挂起线程处理, 需在创建其他线程之前屏蔽
+	static sigset_t parkset;
+	pthread_t parktid;
 
-	//加载磁盘内容
-	if(loadhd() < 0){
+	sigemptyset(&parkset);
+	sigaddset(&parkset, SIGUSR1);
+	sigaddset(&parkset, SIGINT);
+	sigaddset(&parkset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &parkset, NULL);
+	pthread_create(&parktid, NULL, thread_park, &parkset);
+
+	init_resource();
+	atexit(shutdown_resource);
+
+	//加载磁盘内容, 公共内存映像中已包含加载后的内容
+	if(g_config.mempath == NULL && loadhd() < 0){
 		vm_fprintf(stderr, "load harddisk %s failed\n", g_config.hdpath);
 		return -1;
 	}
 
+	if(g_config.memsave && mem_base_save(g_config.memsave) < 0){
+		return -1;
+	}
+
+	vm_fprintf(stdout, "guest private memory %u KiB\n", mem_private_size() / 1024);
+
 	//begin execution
 	if(cpu_proc() < 0){
 		vm_fprintf(stderr, "can not init cpu_proc task\n");
@@ -72,23 +275,19 @@ int main(int argc, char* argv[]){
 }
 
 int loadhd(void){
-	struct vm_file_handle* handle = vm_file_handle_create();
-	if(handle == NULL){
-		vm_fprintf(stderr, "bad harddisk name\n");
-		return -1;
-	}
-
-	//uint32_t hdsize = mem_size();
 	void* memaddr = mem_mbr();
+	uint32_t size = mem_mbr_size();
+
+	//引导程序加载到MBR处, 不能覆盖其后的EBDA和显示缓冲区
+	if(g_config.bootsectors > 0 && g_config.bootsectors < size / VM_HDISK_SECTOR){
+		size = g_config.bootsectors * VM_HDISK_SECTOR;
+	}
 
-	int readbytes = vm_file_handle_read(handle, memaddr, 1024*1024);
+	int readbytes = harddisk_load(memaddr, size);
 	if(readbytes <= 0){
 		vm_fprintf(stderr, "read harddisk failed\n");
-		perror("read haeddisk failed, ");
-		vm_file_handle_destroy(handle);
 		return -1;
 	}
 
-	vm_file_handle_destroy(handle);
 	return 0;
 }
@@ -23,3 +23,45 @@ void* mem_mbr(void){
 	return vm_mbr();
 #endif
 }
+
+uint32_t mem_mbr_size(void){
+#ifdef CPU_8086
+	return vm_mbr_size();
+#endif
+}
+
+int mem_base_map(const char* path){
+#ifdef CPU_8086
+	return vm_base_map(path);
+#endif
+}
+
+int mem_base_save(const char* path){
+#ifdef CPU_8086
+	return vm_base_save(path);
+#endif
+}
+
+uint32_t mem_private_size(void){
+#ifdef CPU_8086
+	return vm_private_size();
+#endif
+}
+
+int mem_park(void){
+#ifdef CPU_8086
+	return vm_park();
+#endif
+}
+
+int mem_unpark(void){
+#ifdef CPU_8086
+	return vm_unpark();
+#endif
+}
+
+void mem_park_stats(struct vm_park_stats* stats){
+#ifdef CPU_8086
+	vm_park_stats_get(stats);
+#endif
+}
@@ -15,5 +15,16 @@ uint32_t mem_size(void);
 void* mem_addr(void);
 
 void* mem_mbr(void);
+uint32_t mem_mbr_size(void);
+
+//公共内存映像
+int mem_base_map(const char* path);
+int mem_base_save(const char* path);
+uint32_t mem_private_size(void);
+
+//空闲guest内存的压缩挂起
+int mem_park(void);
+int mem_unpark(void);
+void mem_park_stats(struct vm_park_stats* stats);
 
 #endif
@@ -0,0 +1,395 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "util/util_cache.h"
+
+#define VM_CACHE_BLOCK	(VM_CACHE_BLOCK_SECTORS * VM_DISK_SECTOR)
+#define VM_CACHE_BATCH	64	//一次合并写回的最多块数(256KiB)
+
+struct vm_cache_line{
+	uint64_t block;		//缓存的块号
+	uint64_t tick;		//最近一次访问的时间, 用于LRU
+	uint8_t valid;
+	uint8_t dirty;
+	uint8_t prefetched;	//预读进来且尚未被访问
+	uint8_t* data;
+};
+
+struct vm_cache{
+	struct vm_disk* disk;
+	struct vm_cache_line* lines;	//nsets * VM_CACHE_WAYS
+	uint32_t* generations;			//每组的写入代数, 组内块被写入或写回时递增
+	uint8_t* data;
+	uint32_t nsets;					//组数, 为2的幂
+	uint64_t tick;
+	int writeback;					//0时写入直接穿透到映像, 缓存块不会变脏
+	struct vm_cache_stats stats;
+	pthread_mutex_t mutex;			//ide线程和cpu线程(int 13h)都会访问
+};
+
+struct vm_cache* vm_cache_create(struct vm_disk* disk, uint32_t mbytes){
+	assert(disk);
+
+	if(mbytes == 0){
+		return NULL;
+	}
+
+	uint64_t lines = (uint64_t)mbytes * 1024 * 1024 / VM_CACHE_BLOCK;
+	uint32_t nsets = 1;
+
+	while((uint64_t)nsets * 2 * VM_CACHE_WAYS <= lines){
+		nsets *= 2;
+	}
+
+	struct vm_cache* cache = (struct vm_cache*)calloc(1, sizeof(struct vm_cache));
+	assert(cache != NULL);
+
+	cache->disk  = disk;
+	cache->nsets = nsets;
+	//只有不要求每次写入都落盘的策略才推迟写回, 否则-y sync/async失去意义
+	//写回时相邻脏块合并为一次pwritev, 因此合并也只在这些策略下生效
+	cache->writeback = disk->sync == VM_FILE_SYNC_FLUSH ||
+		disk->sync == VM_FILE_SYNC_PERIODIC || disk->sync == VM_FILE_SYNC_NONE;
+	cache->lines = (struct vm_cache_line*)calloc((size_t)nsets * VM_CACHE_WAYS, sizeof(struct vm_cache_line));
+	cache->data  = (uint8_t*)malloc((size_t)nsets * VM_CACHE_WAYS * VM_CACHE_BLOCK);
+	cache->generations = (uint32_t*)calloc(nsets, sizeof(uint32_t));
+	assert(cache->lines != NULL && cache->data != NULL && cache->generations != NULL);
+
+	uint32_t i = 0;
+	for(; i < nsets * VM_CACHE_WAYS; i++){
+		cache->lines[i].data = cache->data + (size_t)i * VM_CACHE_BLOCK;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	return cache;
+}
+
+//块中实际存在的扇区数, 映像末尾的块可能不满
+static uint32_t vm_cache_block_sectors(struct vm_cache* cache, uint64_t block){
+	uint64_t left = cache->disk->sectors - block * VM_CACHE_BLOCK_SECTORS;
+
+	return left < VM_CACHE_BLOCK_SECTORS ? (uint32_t)left : VM_CACHE_BLOCK_SECTORS;
+}
+
+static struct vm_cache_line* vm_cache_find(struct vm_cache* cache, uint64_t block);
+
+static uint32_t* vm_cache_generation(struct vm_cache* cache, uint64_t block){
+	return cache->generations + (block & (cache->nsets - 1));
+}
+
+/*
+ * 写回脏块, 与之相邻的脏块一起合并为一次vm_disk_writev
+ */
+static int vm_cache_writeback(struct vm_cache* cache, struct vm_cache_line* line){
+	struct vm_cache_line* run[VM_CACHE_BATCH];
+	struct iovec iov[VM_CACHE_BATCH];
+	struct vm_cache_line* p = NULL;
+	uint64_t first = 0;
+	int n = 0;
+	int i = 0;
+
+	if(!line->valid || !line->dirty){
+		return 0;
+	}
+
+	//向前找到连续脏块的起点, 留出向后合并的余地
+	first = line->block;
+	while(first > 0 && line->block - first < VM_CACHE_BATCH / 2 &&
+			(p = vm_cache_find(cache, first - 1)) != NULL && p->dirty){
+		first--;
+	}
+
+	for(; n < VM_CACHE_BATCH; n++){
+		p = vm_cache_find(cache, first + n);
+		if(p == NULL || !p->dirty){
+			break;
+		}
+
+		run[n] = p;
+		iov[n].iov_base = p->data;
+		iov[n].iov_len  = (size_t)vm_cache_block_sectors(cache, p->block) * VM_DISK_SECTOR;
+	}
+
+	if(vm_disk_writev(cache->disk, first * VM_CACHE_BLOCK_SECTORS, iov, n) < 0){
+		return -1;
+	}
+
+	for(i = 0; i < n; i++){
+		run[i]->dirty = 0;
+		(*vm_cache_generation(cache, run[i]->block))++;
+	}
+
+	cache->stats.writebacks += n;
+	cache->stats.batches++;
+	cache->stats.dirty -= n;
+
+	return 0;
+}
+
+//查找块所在的缓存行, 不更新统计
+static struct vm_cache_line* vm_cache_find(struct vm_cache* cache, uint64_t block){
+	struct vm_cache_line* set = cache->lines + (size_t)(block & (cache->nsets - 1)) * VM_CACHE_WAYS;
+	uint32_t i = 0;
+
+	for(; i < VM_CACHE_WAYS; i++){
+		if(set[i].valid && set[i].block == block){
+			return set + i;
+		}
+	}
+
+	return NULL;
+}
+
+//选出组内空闲或最久未使用的行, 写回后作为块的新行
+static struct vm_cache_line* vm_cache_victim(struct vm_cache* cache, uint64_t block){
+	struct vm_cache_line* set = cache->lines + (size_t)(block & (cache->nsets - 1)) * VM_CACHE_WAYS;
+	struct vm_cache_line* victim = set;
+	uint32_t i = 0;
+
+	for(; i < VM_CACHE_WAYS; i++){
+		if(!set[i].valid){
+			victim = set + i;
+			break;
+		}
+
+		if(set[i].tick < victim->tick){
+			victim = set + i;
+		}
+	}
+
+	if(victim->valid){
+		if(vm_cache_writeback(cache, victim) < 0){
+			return NULL;
+		}
+		cache->stats.evictions++;
+	}
+
+	victim->valid = 0;
+	victim->prefetched = 0;
+
+	return victim;
+}
+
+/*
+ * 查找块所在的缓存行, 未命中时替换组内最久未使用的行
+ * fill为0表示调用者会覆盖整个块, 不需要从映像读取
+ */
+static struct vm_cache_line* vm_cache_lookup(struct vm_cache* cache, uint64_t block, int fill){
+	struct vm_cache_line* line = vm_cache_find(cache, block);
+
+	if(line){
+		line->tick = ++cache->tick;
+		cache->stats.hits++;
+
+		if(line->prefetched){
+			line->prefetched = 0;
+			cache->stats.prefetch_hits++;
+		}
+
+		return line;
+	}
+
+	cache->stats.misses++;
+
+	line = vm_cache_victim(cache, block);
+	if(line == NULL){
+		return NULL;
+	}
+
+	if(fill && vm_disk_read(cache->disk, block * VM_CACHE_BLOCK_SECTORS, line->data,
+				vm_cache_block_sectors(cache, block)) < 0){
+		return NULL;
+	}
+
+	line->block = block;
+	line->tick  = ++cache->tick;
+	line->valid = 1;
+	line->dirty = 0;
+
+	return line;
+}
+
+static int vm_cache_range(struct vm_cache* cache, uint64_t lba, uint32_t count){
+	return lba <= cache->disk->sectors && count <= cache->disk->sectors - lba;
+}
+
+int vm_cache_read(struct vm_cache* cache, uint64_t lba, uint8_t* buffer, uint32_t count){
+	assert(cache);
+	assert(buffer);
+
+	if(!vm_cache_range(cache, lba, count)){
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+
+	while(count > 0){
+		uint64_t block = lba / VM_CACHE_BLOCK_SECTORS;
+		uint32_t offset = lba % VM_CACHE_BLOCK_SECTORS;
+		uint32_t n = VM_CACHE_BLOCK_SECTORS - offset;
+		if(n > count) n = count;
+
+		struct vm_cache_line* line = vm_cache_lookup(cache, block, 1);
+		if(line == NULL){
+			pthread_mutex_unlock(&cache->mutex);
+			return -1;
+		}
+
+		memcpy(buffer, line->data + offset * VM_DISK_SECTOR, n * VM_DISK_SECTOR);
+
+		buffer += n * VM_DISK_SECTOR;
+		lba    += n;
+		count  -= n;
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+int vm_cache_write(struct vm_cache* cache, uint64_t lba, const uint8_t* buffer, uint32_t count){
+	assert(cache);
+	assert(buffer);
+
+	if(!vm_cache_range(cache, lba, count)){
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+
+	//写穿透: 先写映像并按回写策略同步, 再更新缓存中的干净块
+	if(!cache->writeback && vm_disk_write(cache->disk, lba, buffer, count) < 0){
+		pthread_mutex_unlock(&cache->mutex);
+		return -1;
+	}
+
+	while(count > 0){
+		uint64_t block = lba / VM_CACHE_BLOCK_SECTORS;
+		uint32_t offset = lba % VM_CACHE_BLOCK_SECTORS;
+		uint32_t n = VM_CACHE_BLOCK_SECTORS - offset;
+		if(n > count) n = count;
+
+		//覆盖整个块时不需要先读取
+		int whole = offset == 0 && n == vm_cache_block_sectors(cache, block);
+		struct vm_cache_line* line = vm_cache_lookup(cache, block, !whole);
+		if(line == NULL){
+			pthread_mutex_unlock(&cache->mutex);
+			return -1;
+		}
+
+		memcpy(line->data + offset * VM_DISK_SECTOR, buffer, n * VM_DISK_SECTOR);
+		(*vm_cache_generation(cache, block))++;
+
+		if(cache->writeback && !line->dirty){
+			line->dirty = 1;
+			cache->stats.dirty++;
+		}
+
+		buffer += n * VM_DISK_SECTOR;
+		lba    += n;
+		count  -= n;
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+int vm_cache_flush(struct vm_cache* cache){
+	int ret = 0;
+	uint32_t i = 0;
+
+	assert(cache);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	for(; i < cache->nsets * VM_CACHE_WAYS; i++){
+		if(vm_cache_writeback(cache, cache->lines + i) < 0){
+			ret = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret;
+}
+
+int vm_cache_prefetch(struct vm_cache* cache, uint64_t lba, uint32_t count){
+	uint8_t data[VM_CACHE_BLOCK];
+
+	assert(cache);
+
+	if(lba >= cache->disk->sectors){
+		return 0;
+	}
+
+	if(count > cache->disk->sectors - lba){
+		count = cache->disk->sectors - lba;
+	}
+
+	uint64_t block = lba / VM_CACHE_BLOCK_SECTORS;
+	uint64_t last = (lba + count + VM_CACHE_BLOCK_SECTORS - 1) / VM_CACHE_BLOCK_SECTORS;
+
+	for(; block < last; block++){
+		pthread_mutex_lock(&cache->mutex);
+		int present = vm_cache_find(cache, block) != NULL;
+		uint32_t generation = *vm_cache_generation(cache, block);
+		pthread_mutex_unlock(&cache->mutex);
+
+		if(present){
+			continue;
+		}
+
+		//读取映像时不持有锁, 不阻塞cpu线程的访问
+		if(vm_disk_read(cache->disk, block * VM_CACHE_BLOCK_SECTORS, data,
+					vm_cache_block_sectors(cache, block)) < 0){
+			return -1;
+		}
+
+		pthread_mutex_lock(&cache->mutex);
+
+		//期间可能已被其他线程读入或写入, 组内有写入或写回时读到的数据可能已过期, 直接丢弃
+		struct vm_cache_line* line = vm_cache_find(cache, block);
+		if(line == NULL && generation == *vm_cache_generation(cache, block)){
+			line = vm_cache_victim(cache, block);
+			if(line){
+				memcpy(line->data, data, VM_CACHE_BLOCK);
+				line->block = block;
+				line->tick  = ++cache->tick;
+				line->valid = 1;
+				line->dirty = 0;
+				line->prefetched = 1;
+				cache->stats.prefetched++;
+			}
+		}
+
+		pthread_mutex_unlock(&cache->mutex);
+	}
+
+	return 0;
+}
+
+void vm_cache_stats_get(struct vm_cache* cache, struct vm_cache_stats* stats){
+	assert(cache);
+	assert(stats);
+
+	pthread_mutex_lock(&cache->mutex);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void vm_cache_destroy(struct vm_cache* cache){
+	assert(cache);
+
+	vm_cache_flush(cache);
+
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache->data);
+	free(cache->lines);
+	free(cache->generations);
+	free(cache);
+}
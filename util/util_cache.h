@@ -0,0 +1,46 @@
+#ifndef VM_UTIL_CACHE_H
+#define VM_UTIL_CACHE_H
+
+#include <stdint.h>
+#include "util/util_file.h"
+
+#define VM_CACHE_BLOCK_SECTORS	8	//每个缓存块8个扇区(4KiB)
+#define VM_CACHE_WAYS			8	//组相联的路数
+
+/*
+ * 磁盘映像之上的组相联扇区缓存, 每组内按LRU替换
+ * 回写策略为FLUSH, PERIODIC或NONE时, 写入只修改缓存块并标记为脏, 替换或flush时才写回映像
+ * 其他策略下写入穿透到映像, 缓存只加速读取
+ */
+struct vm_cache;
+
+struct vm_cache_stats{
+	uint64_t hits;			//命中的块访问次数
+	uint64_t misses;		//未命中的块访问次数
+	uint64_t evictions;		//被替换的有效块
+	uint64_t writebacks;	//写回映像的脏块
+	uint64_t batches;		//合并后写回映像的次数
+	uint64_t prefetched;	//预读进来的块
+	uint64_t prefetch_hits;	//预读的块之后被访问到
+	uint32_t dirty;			//当前的脏块数
+};
+
+//创建mbytes MiB大小的缓存, 大小为0时返回NULL
+struct vm_cache* vm_cache_create(struct vm_disk* disk, uint32_t mbytes);
+
+//读写count个扇区, 成功返回0
+int vm_cache_read(struct vm_cache* cache, uint64_t lba, uint8_t* buffer, uint32_t count);
+int vm_cache_write(struct vm_cache* cache, uint64_t lba, const uint8_t* buffer, uint32_t count);
+
+//把[lba, lba + count)中不在缓存里的块读入缓存, 读取映像时不持有锁
+int vm_cache_prefetch(struct vm_cache* cache, uint64_t lba, uint32_t count);
+
+//写回所有脏块, 成功返回0
+int vm_cache_flush(struct vm_cache* cache);
+
+void vm_cache_stats_get(struct vm_cache* cache, struct vm_cache_stats* stats);
+
+//写回脏块并释放缓存
+void vm_cache_destroy(struct vm_cache* cache);
+
+#endif
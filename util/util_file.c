@@ -1,57 +1,1019 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "util/util_file.h"
+#include "util/util_lz.h"
 
-struct vm_file_handle* vm_file_handle_create(void){
-	struct vm_file_handle* handle = (struct vm_file_handle*)malloc(sizeof(struct vm_file_handle));
+#define VM_IMAGE_CLUSTER (VM_IMAGE_CLUSTER_SECTORS * VM_DISK_SECTOR)
+#define VM_COMPRESS_CHUNK (VM_COMPRESS_CHUNK_SECTORS * VM_DISK_SECTOR)
 
-	assert(handle != NULL);
-	
-	handle->fd = open(g_config.hdpath, O_RDWR);
-	if(handle->fd <= 0){
-		free(handle);
+static struct vm_disk* vm_disk_open_mode(const char* path, int flags, int sync);
+static int vm_image_open(struct vm_disk* disk, struct vm_image_header* header);
+static int vm_compress_open(struct vm_disk* disk, struct vm_image_header* header);
+static struct vm_chunk_store* vm_chunk_store_open(const char* path);
+static void vm_chunk_store_close(struct vm_chunk_store* store);
+
+//压缩映像只读, 打开时不需要写权限
+static int vm_disk_compressed(const char* path){
+	char magic[8];
+	int fd = open(path, O_RDONLY);
+	int compressed = 0;
+
+	if(fd < 0){
+		return 0;
+	}
+
+	compressed = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+		memcmp(magic, VM_COMPRESS_MAGIC, sizeof(magic)) == 0;
+	close(fd);
+
+	return compressed;
+}
+
+struct vm_disk* vm_disk_open(const char* path, int sync){
+	return vm_disk_open_mode(path, vm_disk_compressed(path) ? O_RDONLY : O_RDWR, sync);
+}
+
+static struct vm_disk* vm_disk_open_mode(const char* path, int flags, int sync){
+	struct stat st;
+	struct vm_image_header header;
+	struct vm_disk* disk = (struct vm_disk*)calloc(1, sizeof(struct vm_disk));
+
+	assert(disk != NULL);
+
+	disk->fd = open(path, flags);
+	if(disk->fd < 0){
+		vm_fprintf(stderr, "can not open disk image %s\n", path);
+		free(disk);
+		return NULL;
+	}
+
+	//只在打开时校验一次映像
+	if(fstat(disk->fd, &st) < 0 || st.st_size < VM_DISK_SECTOR){
+		vm_fprintf(stderr, "bad disk image %s\n", path);
+		close(disk->fd);
+		free(disk);
+		return NULL;
+	}
+
+	disk->sync = sync;
+	pthread_mutex_init(&disk->mutex, NULL);
+
+	if(pread(disk->fd, &header, sizeof(header), 0) == sizeof(header) &&
+			(memcmp(header.magic, VM_OVERLAY_MAGIC, sizeof(header.magic)) == 0 ||
+			 memcmp(header.magic, VM_SPARSE_MAGIC, sizeof(header.magic)) == 0 ||
+			 memcmp(header.magic, VM_DEDUP_MAGIC, sizeof(header.magic)) == 0)){
+		if(vm_image_open(disk, &header) < 0){
+			vm_fprintf(stderr, "bad disk image %s\n", path);
+			vm_disk_close(disk);
+			return NULL;
+		}
+		return disk;
+	}
+
+	if(memcmp(header.magic, VM_COMPRESS_MAGIC, sizeof(header.magic)) == 0){
+		if(vm_compress_open(disk, &header) < 0){
+			vm_fprintf(stderr, "bad compressed image %s\n", path);
+			vm_disk_close(disk);
+			return NULL;
+		}
+		return disk;
+	}
+
+	if(st.st_size % VM_DISK_SECTOR != 0){
+		vm_fprintf(stderr, "disk image %s is not sector aligned, %llu bytes ignored\n",
+				path, (unsigned long long)(st.st_size % VM_DISK_SECTOR));
+	}
+
+	disk->type    = VM_DISK_RAW;
+	disk->size    = st.st_size;
+	disk->sectors = st.st_size / VM_DISK_SECTOR;
+	disk->addr    = (uint8_t*)mmap(NULL, disk->size,
+			(flags & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+
+	//无法映射时退回pread/pwrite
+	if(disk->addr == MAP_FAILED){
+		disk->addr = NULL;
+	}
+
+	return disk;
+}
+
+/*
+ * 打开overlay, 稀疏或去重映像: 把分配表读入内存
+ * overlay还需只读打开基础映像, 去重映像需打开共享块存储
+ */
+static int vm_image_open(struct vm_disk* disk, struct vm_image_header* header){
+	uint32_t i = 0;
+
+	header->base[sizeof(header->base) - 1] = 0;
+
+	if(header->cluster_sectors != VM_IMAGE_CLUSTER_SECTORS ||
+			header->clusters != (header->sectors + VM_IMAGE_CLUSTER_SECTORS - 1) / VM_IMAGE_CLUSTER_SECTORS){
+		return -1;
+	}
+
+	if(memcmp(header->magic, VM_SPARSE_MAGIC, sizeof(header->magic)) == 0){
+		disk->type = VM_DISK_SPARSE;
+	} else if(memcmp(header->magic, VM_DEDUP_MAGIC, sizeof(header->magic)) == 0){
+		disk->type = VM_DISK_DEDUP;
+	} else {
+		disk->type = VM_DISK_OVERLAY;
+	}
+	disk->sectors      = header->sectors;
+	disk->size         = header->sectors * VM_DISK_SECTOR;
+	disk->clusters     = header->clusters;
+	disk->table_offset = header->table_offset;
+	disk->data_offset  = header->data_offset;
+
+	if(disk->type == VM_DISK_OVERLAY){
+		disk->base = vm_disk_open_mode(header->base, O_RDONLY, VM_FILE_SYNC_NONE);
+		if(disk->base == NULL || disk->base->sectors < disk->sectors){
+			return -1;
+		}
+	} else if(disk->type == VM_DISK_DEDUP){
+		disk->store = vm_chunk_store_open(header->base);
+		if(disk->store == NULL){
+			return -1;
+		}
+	}
+
+	disk->table = (uint32_t*)malloc((size_t)disk->clusters * sizeof(uint32_t));
+	assert(disk->table != NULL);
+
+	size_t bytes = (size_t)disk->clusters * sizeof(uint32_t);
+	if(pread(disk->fd, disk->table, bytes, header->table_offset) != (ssize_t)bytes){
+		return -1;
+	}
+
+	//去重映像的表项是块号, 只统计映射的簇数
+	for(; i < disk->clusters; i++){
+		if(disk->type == VM_DISK_DEDUP){
+			disk->allocated += disk->table[i] != 0;
+		} else if(disk->table[i] > disk->allocated){
+			disk->allocated = disk->table[i];
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * 新建overlay或稀疏映像, 只写入头部
+ */
+static int vm_image_create(const char* path, const char* magic, uint64_t sectors, const char* base){
+	struct vm_image_header header;
+
+	if(sectors == 0 || strlen(base) >= sizeof(header.base)){
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, magic, sizeof(header.magic));
+	strcpy(header.base, base);
+	header.sectors         = sectors;
+	header.cluster_sectors = VM_IMAGE_CLUSTER_SECTORS;
+	header.clusters        = (sectors + VM_IMAGE_CLUSTER_SECTORS - 1) / VM_IMAGE_CLUSTER_SECTORS;
+	header.table_offset    = VM_DISK_SECTOR;
+
+	//数据区按簇对齐
+	uint64_t end = header.table_offset + (uint64_t)header.clusters * sizeof(uint32_t);
+	header.data_offset = (uint32_t)((end + VM_IMAGE_CLUSTER - 1) / VM_IMAGE_CLUSTER * VM_IMAGE_CLUSTER);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0){
+		return -1;
+	}
+
+	//分配表全为0, 由ftruncate留下空洞
+	if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || ftruncate(fd, header.data_offset) < 0){
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+int vm_disk_overlay_create(const char* path, const char* base){
+	char resolved[PATH_MAX];
+	struct vm_disk* disk = vm_disk_open_mode(base, O_RDONLY, VM_FILE_SYNC_NONE);
+
+	if(disk == NULL){
+		return -1;
+	}
+
+	uint64_t sectors = disk->sectors;
+	vm_disk_close(disk);
+
+	//记录绝对路径, 之后从其他目录启动也能找到基础映像
+	if(realpath(base, resolved) == NULL){
+		return -1;
+	}
+
+	return vm_image_create(path, VM_OVERLAY_MAGIC, sectors, resolved);
+}
+
+int vm_disk_sparse_create(const char* path, uint64_t sectors){
+	return vm_image_create(path, VM_SPARSE_MAGIC, sectors, "");
+}
+
+int vm_disk_dedup_create(const char* path, const char* store, uint64_t sectors){
+	return vm_image_create(path, VM_DEDUP_MAGIC, sectors, store);
+}
+
+/*
+ * 共享块存储, 进程内的哈希表索引已载入的块
+ */
+struct vm_chunk_store{
+	int fd;				//块数据
+	int hash_fd;		//块哈希
+	uint32_t count;		//已载入索引的块数, 包括第0块
+	uint64_t* hashes;	//开放寻址哈希表
+	uint32_t* ids;		//块号, 0表示空位
+	uint32_t capacity;	//哈希表大小, 为2的幂
+	uint32_t used;
+	pthread_mutex_t mutex;
+};
+
+static uint64_t vm_chunk_hash(const uint8_t* data){
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	uint32_t i = 0;
+
+	for(; i < VM_IMAGE_CLUSTER; i += 8){
+		uint64_t v;
+		memcpy(&v, data + i, sizeof(v));
+		h ^= v * 0xff51afd7ed558ccdULL;
+		h = ((h << 31) | (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void vm_chunk_store_insert(struct vm_chunk_store* store, uint64_t hash, uint32_t id){
+	uint32_t i = 0;
+
+	//装载因子超过一半时扩大一倍
+	if((store->used + 1) * 2 > store->capacity){
+		uint32_t capacity = store->capacity;
+		uint64_t* hashes = store->hashes;
+		uint32_t* ids = store->ids;
+
+		store->capacity = capacity * 2;
+		store->hashes = (uint64_t*)calloc(store->capacity, sizeof(uint64_t));
+		store->ids = (uint32_t*)calloc(store->capacity, sizeof(uint32_t));
+		assert(store->hashes != NULL && store->ids != NULL);
+		store->used = 0;
+
+		for(i = 0; i < capacity; i++){
+			if(ids[i]){
+				vm_chunk_store_insert(store, hashes[i], ids[i]);
+			}
+		}
+
+		free(hashes);
+		free(ids);
+	}
+
+	for(i = (uint32_t)hash & (store->capacity - 1); store->ids[i]; i = (i + 1) & (store->capacity - 1));
+
+	store->hashes[i] = hash;
+	store->ids[i] = id;
+	store->used++;
+}
+
+/*
+ * 载入其他进程追加的块的哈希, 调用时持有flock
+ */
+static int vm_chunk_store_refresh(struct vm_chunk_store* store){
+	uint64_t hashes[512];
+	struct stat st;
+
+	if(fstat(store->hash_fd, &st) < 0){
+		return -1;
+	}
+
+	uint32_t count = (uint32_t)(st.st_size / sizeof(uint64_t));
+
+	while(store->count < count){
+		uint32_t n = count - store->count;
+		uint32_t i = 0;
+		if(n > sizeof(hashes) / sizeof(hashes[0])) n = sizeof(hashes) / sizeof(hashes[0]);
+
+		size_t bytes = n * sizeof(uint64_t);
+		if(pread(store->hash_fd, hashes, bytes, (uint64_t)store->count * sizeof(uint64_t)) != (ssize_t)bytes){
+			return -1;
+		}
+
+		for(; i < n; i++){
+			vm_chunk_store_insert(store, hashes[i], store->count + i);
+		}
+		store->count += n;
+	}
+
+	return 0;
+}
+
+static struct vm_chunk_store* vm_chunk_store_open(const char* path){
+	char hash_path[sizeof(((struct vm_image_header*)0)->base) + 8];
+	struct vm_chunk_store* store = (struct vm_chunk_store*)calloc(1, sizeof(struct vm_chunk_store));
+
+	assert(store != NULL);
+
+	store->capacity = 1024;
+	store->hashes = (uint64_t*)calloc(store->capacity, sizeof(uint64_t));
+	store->ids = (uint32_t*)calloc(store->capacity, sizeof(uint32_t));
+	assert(store->hashes != NULL && store->ids != NULL);
+
+	snprintf(hash_path, sizeof(hash_path), "%s.hash", path);
+
+	store->fd = open(path, O_RDWR | O_CREAT, 0644);
+	store->hash_fd = open(hash_path, O_RDWR | O_CREAT, 0644);
+	pthread_mutex_init(&store->mutex, NULL);
+
+	if(store->fd < 0 || store->hash_fd < 0 || flock(store->fd, LOCK_EX) < 0){
+		vm_fprintf(stderr, "can not open chunk store %s\n", path);
+		vm_chunk_store_close(store);
+		return NULL;
+	}
+
+	//新建的存储写入头部, 第0块不对应任何数据
+	struct stat st;
+	char magic[VM_DISK_SECTOR];
+	int ret = fstat(store->fd, &st);
+
+	if(ret == 0 && st.st_size == 0){
+		uint64_t hash = 0;
+
+		memset(magic, 0, sizeof(magic));
+		memcpy(magic, VM_CHUNK_STORE_MAGIC, 8);
+		ret = pwrite(store->fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+			pwrite(store->hash_fd, &hash, sizeof(hash), 0) == sizeof(hash) ? 0 : -1;
+	} else if(ret == 0){
+		ret = pread(store->fd, magic, 8, 0) == 8 && memcmp(magic, VM_CHUNK_STORE_MAGIC, 8) == 0 ? 0 : -1;
+	}
+
+	//第0块不进入索引
+	store->count = 1;
+	if(ret == 0){
+		ret = vm_chunk_store_refresh(store);
+	}
+
+	flock(store->fd, LOCK_UN);
+
+	if(ret < 0){
+		vm_fprintf(stderr, "bad chunk store %s\n", path);
+		vm_chunk_store_close(store);
+		return NULL;
+	}
+
+	return store;
+}
+
+/*
+ * 返回内容为data的块号, 不存在时追加, 失败返回0
+ */
+static uint32_t vm_chunk_store_put(struct vm_chunk_store* store, const uint8_t* data){
+	uint8_t chunk[VM_IMAGE_CLUSTER];
+	uint64_t hash = vm_chunk_hash(data);
+	uint32_t id = 0;
+	uint32_t i = 0;
+
+	pthread_mutex_lock(&store->mutex);
+
+	if(flock(store->fd, LOCK_EX) < 0){
+		pthread_mutex_unlock(&store->mutex);
+		return 0;
+	}
+
+	if(vm_chunk_store_refresh(store) == 0){
+		//哈希相同时比较内容
+		for(i = (uint32_t)hash & (store->capacity - 1); store->ids[i]; i = (i + 1) & (store->capacity - 1)){
+			if(store->hashes[i] == hash &&
+					pread(store->fd, chunk, sizeof(chunk), (uint64_t)store->ids[i] * VM_IMAGE_CLUSTER) == sizeof(chunk) &&
+					memcmp(chunk, data, sizeof(chunk)) == 0){
+				id = store->ids[i];
+				break;
+			}
+		}
+
+		//先写数据, 写入哈希之后其他进程才能看到该块
+		if(id == 0 &&
+				pwrite(store->fd, data, VM_IMAGE_CLUSTER, (uint64_t)store->count * VM_IMAGE_CLUSTER) == VM_IMAGE_CLUSTER &&
+				pwrite(store->hash_fd, &hash, sizeof(hash), (uint64_t)store->count * sizeof(hash)) == sizeof(hash)){
+			id = store->count++;
+			vm_chunk_store_insert(store, hash, id);
+		}
+	}
+
+	flock(store->fd, LOCK_UN);
+	pthread_mutex_unlock(&store->mutex);
+
+	return id;
+}
+
+static int vm_chunk_store_sync(struct vm_chunk_store* store){
+	return fdatasync(store->fd) == 0 && fdatasync(store->hash_fd) == 0 ? 0 : -1;
+}
+
+static void vm_chunk_store_close(struct vm_chunk_store* store){
+	if(store->fd >= 0) close(store->fd);
+	if(store->hash_fd >= 0) close(store->hash_fd);
+	free(store->hashes);
+	free(store->ids);
+	pthread_mutex_destroy(&store->mutex);
+	free(store);
+}
+
+uint32_t vm_disk_dedup_chunks(struct vm_disk* disk){
+	assert(disk && disk->store);
+
+	pthread_mutex_lock(&disk->store->mutex);
+	uint32_t count = disk->store->count - 1;
+	pthread_mutex_unlock(&disk->store->mutex);
+
+	return count;
+}
+
+/*
+ * 打开压缩映像: 把索引读入内存并校验单调递增
+ */
+static int vm_compress_open(struct vm_disk* disk, struct vm_image_header* header){
+	uint32_t i = 0;
+
+	if(header->cluster_sectors != VM_COMPRESS_CHUNK_SECTORS ||
+			header->clusters != (header->sectors + VM_COMPRESS_CHUNK_SECTORS - 1) / VM_COMPRESS_CHUNK_SECTORS){
+		return -1;
+	}
+
+	disk->type         = VM_DISK_COMPRESSED;
+	disk->sectors      = header->sectors;
+	disk->size         = header->sectors * VM_DISK_SECTOR;
+	disk->clusters     = header->clusters;
+	disk->table_offset = header->table_offset;
+	disk->data_offset  = header->data_offset;
+
+	size_t bytes = ((size_t)disk->clusters + 1) * sizeof(uint64_t);
+	disk->index = (uint64_t*)malloc(bytes);
+	assert(disk->index != NULL);
+
+	if(pread(disk->fd, disk->index, bytes, header->table_offset) != (ssize_t)bytes){
+		return -1;
+	}
+
+	for(; i < disk->clusters; i++){
+		if(disk->index[i] < disk->data_offset || disk->index[i + 1] < disk->index[i] ||
+				disk->index[i + 1] - disk->index[i] > VM_COMPRESS_CHUNK){
+			return -1;
+		}
+	}
+
+	disk->chunks = (struct vm_disk_chunk*)calloc(VM_COMPRESS_CACHE_CHUNKS, sizeof(struct vm_disk_chunk));
+	assert(disk->chunks != NULL);
+
+	return 0;
+}
+
+/*
+ * 把原始映像按块压缩, 先写数据区, 最后写入索引和头部
+ */
+int vm_disk_compress_create(const char* path, const char* raw){
+	struct vm_image_header header;
+	uint8_t data[VM_COMPRESS_CHUNK];
+	uint8_t packed[VM_COMPRESS_CHUNK];
+	struct vm_disk* disk = vm_disk_open_mode(raw, O_RDONLY, VM_FILE_SYNC_NONE);
+	uint32_t i = 0;
+
+	if(disk == NULL){
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VM_COMPRESS_MAGIC, sizeof(header.magic));
+	header.sectors         = disk->sectors;
+	header.cluster_sectors = VM_COMPRESS_CHUNK_SECTORS;
+	header.clusters        = (disk->sectors + VM_COMPRESS_CHUNK_SECTORS - 1) / VM_COMPRESS_CHUNK_SECTORS;
+	header.table_offset    = VM_DISK_SECTOR;
+
+	uint64_t end = header.table_offset + ((uint64_t)header.clusters + 1) * sizeof(uint64_t);
+	header.data_offset = (uint32_t)((end + VM_DISK_SECTOR - 1) / VM_DISK_SECTOR * VM_DISK_SECTOR);
+
+	uint64_t* index = (uint64_t*)malloc(((size_t)header.clusters + 1) * sizeof(uint64_t));
+	assert(index != NULL);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0){
+		free(index);
+		vm_disk_close(disk);
+		return -1;
+	}
+
+	index[0] = header.data_offset;
+
+	for(; i < header.clusters; i++){
+		uint64_t first = (uint64_t)i * VM_COMPRESS_CHUNK_SECTORS;
+		uint32_t valid = disk->sectors - first < VM_COMPRESS_CHUNK_SECTORS ?
+			(uint32_t)(disk->sectors - first) : VM_COMPRESS_CHUNK_SECTORS;
+		uint32_t bytes = valid * VM_DISK_SECTOR;
+
+		if(vm_disk_read(disk, first, data, valid) < 0){
+			break;
+		}
+
+		//压缩后必须变小, 否则原样保存
+		int len = vm_lz_compress(data, bytes, packed, bytes - 1);
+		const uint8_t* out = len > 0 ? packed : data;
+		if(len <= 0) len = (int)bytes;
+
+		if(pwrite(fd, out, len, index[i]) != len){
+			break;
+		}
+
+		index[i + 1] = index[i] + len;
+	}
+
+	size_t bytes = ((size_t)header.clusters + 1) * sizeof(uint64_t);
+	int ret = i == header.clusters &&
+		pwrite(fd, index, bytes, header.table_offset) == (ssize_t)bytes &&
+		pwrite(fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+
+	close(fd);
+	if(ret < 0){
+		unlink(path);
+	}
+
+	free(index);
+	vm_disk_close(disk);
+
+	return ret;
+}
+
+static int vm_disk_range(struct vm_disk* disk, uint64_t lba, uint32_t count){
+	return lba <= disk->sectors && count <= disk->sectors - lba;
+}
+
+static uint64_t vm_image_offset(struct vm_disk* disk, uint32_t index){
+	return disk->data_offset + (uint64_t)(index - 1) * VM_IMAGE_CLUSTER;
+}
+
+/*
+ * 按簇处理, 未分配的簇在overlay中从基础映像读取, 在稀疏映像中直接填0
+ */
+static int vm_image_read(struct vm_disk* disk, uint64_t lba, uint8_t* buffer, uint32_t count){
+	while(count > 0){
+		uint32_t cluster = (uint32_t)(lba / VM_IMAGE_CLUSTER_SECTORS);
+		uint32_t offset = lba % VM_IMAGE_CLUSTER_SECTORS;
+		uint32_t n = VM_IMAGE_CLUSTER_SECTORS - offset;
+		if(n > count) n = count;
+
+		pthread_mutex_lock(&disk->mutex);
+		uint32_t index = disk->table[cluster];
+		pthread_mutex_unlock(&disk->mutex);
+
+		if(index){
+			size_t bytes = (size_t)n * VM_DISK_SECTOR;
+			if(pread(disk->fd, buffer, bytes, vm_image_offset(disk, index) + offset * VM_DISK_SECTOR) != (ssize_t)bytes){
+				return -1;
+			}
+		} else if(disk->base == NULL){
+			memset(buffer, 0, (size_t)n * VM_DISK_SECTOR);
+		} else if(vm_disk_read(disk->base, lba, buffer, n) < 0){
+			return -1;
+		}
+
+		buffer += n * VM_DISK_SECTOR;
+		lba    += n;
+		count  -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * 第一次写入簇时分配整簇, overlay从基础映像复制未写入的部分
+ * 先写数据再写分配表项
+ */
+static int vm_image_write(struct vm_disk* disk, uint64_t lba, const uint8_t* buffer, uint32_t count){
+	uint8_t data[VM_IMAGE_CLUSTER];
+
+	while(count > 0){
+		uint32_t cluster = (uint32_t)(lba / VM_IMAGE_CLUSTER_SECTORS);
+		uint32_t offset = lba % VM_IMAGE_CLUSTER_SECTORS;
+		uint32_t n = VM_IMAGE_CLUSTER_SECTORS - offset;
+		if(n > count) n = count;
+
+		pthread_mutex_lock(&disk->mutex);
+
+		uint32_t index = disk->table[cluster];
+		size_t bytes = (size_t)n * VM_DISK_SECTOR;
+
+		if(index){
+			if(pwrite(disk->fd, buffer, bytes, vm_image_offset(disk, index) + offset * VM_DISK_SECTOR) != (ssize_t)bytes){
+				pthread_mutex_unlock(&disk->mutex);
+				return -1;
+			}
+		} else {
+			uint64_t first = (uint64_t)cluster * VM_IMAGE_CLUSTER_SECTORS;
+			uint32_t valid = disk->sectors - first < VM_IMAGE_CLUSTER_SECTORS ?
+				(uint32_t)(disk->sectors - first) : VM_IMAGE_CLUSTER_SECTORS;
+
+			memset(data, 0, sizeof(data));
+			if(disk->base && vm_disk_read(disk->base, first, data, valid) < 0){
+				pthread_mutex_unlock(&disk->mutex);
+				return -1;
+			}
+			memcpy(data + offset * VM_DISK_SECTOR, buffer, bytes);
+
+			index = disk->allocated + 1;
+
+			if(pwrite(disk->fd, data, sizeof(data), vm_image_offset(disk, index)) != sizeof(data) ||
+					pwrite(disk->fd, &index, sizeof(index), disk->table_offset + (uint64_t)cluster * sizeof(index)) != sizeof(index)){
+				pthread_mutex_unlock(&disk->mutex);
+				return -1;
+			}
+
+			disk->table[cluster] = index;
+			disk->allocated = index;
+		}
+
+		pthread_mutex_unlock(&disk->mutex);
+
+		buffer += bytes;
+		lba    += n;
+		count  -= n;
+	}
+
+	return vm_disk_sync(disk, lba, 0);
+}
+
+/*
+ * 取得解压后的块, 调用时持有disk->mutex
+ */
+static struct vm_disk_chunk* vm_compress_chunk(struct vm_disk* disk, uint32_t chunk){
+	uint8_t packed[VM_COMPRESS_CHUNK];
+	struct vm_disk_chunk* slot = disk->chunks + chunk % VM_COMPRESS_CACHE_CHUNKS;
+
+	if(slot->chunk == chunk + 1){
+		return slot;
+	}
+
+	uint64_t first = (uint64_t)chunk * VM_COMPRESS_CHUNK_SECTORS;
+	uint32_t bytes = (disk->sectors - first < VM_COMPRESS_CHUNK_SECTORS ?
+		(uint32_t)(disk->sectors - first) : VM_COMPRESS_CHUNK_SECTORS) * VM_DISK_SECTOR;
+	uint32_t len = (uint32_t)(disk->index[chunk + 1] - disk->index[chunk]);
+
+	slot->chunk = 0;
+
+	//与块大小相同的是原样保存的块
+	if(len == bytes){
+		if(pread(disk->fd, slot->data, bytes, disk->index[chunk]) != (ssize_t)bytes){
+			return NULL;
+		}
+	} else if(pread(disk->fd, packed, len, disk->index[chunk]) != (ssize_t)len ||
+			vm_lz_decompress(packed, len, slot->data, bytes) != (int)bytes){
+		return NULL;
+	}
+
+	slot->chunk = chunk + 1;
+
+	return slot;
+}
+
+static int vm_compress_read(struct vm_disk* disk, uint64_t lba, uint8_t* buffer, uint32_t count){
+	while(count > 0){
+		uint32_t chunk = (uint32_t)(lba / VM_COMPRESS_CHUNK_SECTORS);
+		uint32_t offset = lba % VM_COMPRESS_CHUNK_SECTORS;
+		uint32_t n = VM_COMPRESS_CHUNK_SECTORS - offset;
+		if(n > count) n = count;
+
+		pthread_mutex_lock(&disk->mutex);
+
+		struct vm_disk_chunk* slot = vm_compress_chunk(disk, chunk);
+		if(slot == NULL){
+			pthread_mutex_unlock(&disk->mutex);
+			return -1;
+		}
+		memcpy(buffer, slot->data + offset * VM_DISK_SECTOR, (size_t)n * VM_DISK_SECTOR);
+
+		pthread_mutex_unlock(&disk->mutex);
+
+		buffer += n * VM_DISK_SECTOR;
+		lba    += n;
+		count  -= n;
+	}
+
+	return 0;
+}
+
+static int vm_dedup_read(struct vm_disk* disk, uint64_t lba, uint8_t* buffer, uint32_t count){
+	while(count > 0){
+		uint32_t cluster = (uint32_t)(lba / VM_IMAGE_CLUSTER_SECTORS);
+		uint32_t offset = lba % VM_IMAGE_CLUSTER_SECTORS;
+		uint32_t n = VM_IMAGE_CLUSTER_SECTORS - offset;
+		if(n > count) n = count;
+
+		pthread_mutex_lock(&disk->mutex);
+		uint32_t id = disk->table[cluster];
+		pthread_mutex_unlock(&disk->mutex);
+
+		size_t bytes = (size_t)n * VM_DISK_SECTOR;
+		if(id == 0){
+			memset(buffer, 0, bytes);
+		} else if(pread(disk->store->fd, buffer, bytes,
+					(uint64_t)id * VM_IMAGE_CLUSTER + offset * VM_DISK_SECTOR) != (ssize_t)bytes){
+			return -1;
+		}
+
+		buffer += bytes;
+		lba    += n;
+		count  -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * 块不可修改, 写入簇时合成新内容后重新映射, 部分写入需要先读出原内容
+ */
+static int vm_dedup_write(struct vm_disk* disk, uint64_t lba, const uint8_t* buffer, uint32_t count){
+	uint8_t data[VM_IMAGE_CLUSTER];
+	static const uint8_t zero[VM_IMAGE_CLUSTER];
+
+	while(count > 0){
+		uint32_t cluster = (uint32_t)(lba / VM_IMAGE_CLUSTER_SECTORS);
+		uint32_t offset = lba % VM_IMAGE_CLUSTER_SECTORS;
+		uint32_t n = VM_IMAGE_CLUSTER_SECTORS - offset;
+		if(n > count) n = count;
+
+		size_t bytes = (size_t)n * VM_DISK_SECTOR;
+
+		pthread_mutex_lock(&disk->mutex);
+
+		uint32_t old = disk->table[cluster];
+
+		if(bytes < sizeof(data)){
+			if(old == 0){
+				memset(data, 0, sizeof(data));
+			} else if(pread(disk->store->fd, data, sizeof(data), (uint64_t)old * VM_IMAGE_CLUSTER) != sizeof(data)){
+				pthread_mutex_unlock(&disk->mutex);
+				return -1;
+			}
+		}
+		memcpy(data + offset * VM_DISK_SECTOR, buffer, bytes);
+
+		//全0的簇不占用块
+		int empty = memcmp(data, zero, sizeof(data)) == 0;
+		uint32_t id = empty ? 0 : vm_chunk_store_put(disk->store, data);
+		if(id == 0 && !empty){
+			pthread_mutex_unlock(&disk->mutex);
+			return -1;
+		}
+
+		if(id != old){
+			if(pwrite(disk->fd, &id, sizeof(id), disk->table_offset + (uint64_t)cluster * sizeof(id)) != sizeof(id)){
+				pthread_mutex_unlock(&disk->mutex);
+				return -1;
+			}
+
+			disk->table[cluster] = id;
+			disk->allocated += (id != 0) - (old != 0);
+		}
+
+		pthread_mutex_unlock(&disk->mutex);
+
+		buffer += bytes;
+		lba    += n;
+		count  -= n;
+	}
+
+	return vm_disk_sync(disk, lba, 0);
+}
+
+uint8_t* vm_disk_addr(struct vm_disk* disk, uint64_t lba, uint32_t count){
+	assert(disk);
+
+	if(disk->addr == NULL || !vm_disk_range(disk, lba, count)){
 		return NULL;
 	}
 
-	return handle;
+	return disk->addr + lba * VM_DISK_SECTOR;
+}
+
+int vm_disk_read(struct vm_disk* disk, uint64_t lba, uint8_t* buffer, uint32_t count){
+	size_t bytes = (size_t)count * VM_DISK_SECTOR;
+
+	assert(disk);
+	assert(buffer);
+
+	if(!vm_disk_range(disk, lba, count)){
+		return -1;
+	}
+
+	if(disk->type == VM_DISK_COMPRESSED){
+		return vm_compress_read(disk, lba, buffer, count);
+	} else if(disk->type == VM_DISK_DEDUP){
+		return vm_dedup_read(disk, lba, buffer, count);
+	} else if(disk->type != VM_DISK_RAW){
+		return vm_image_read(disk, lba, buffer, count);
+	}
+
+	if(disk->addr){
+		memcpy(buffer, disk->addr + lba * VM_DISK_SECTOR, bytes);
+		return 0;
+	}
+
+	return pread(disk->fd, buffer, bytes, lba * VM_DISK_SECTOR) == (ssize_t)bytes ? 0 : -1;
+}
+
+int vm_disk_write(struct vm_disk* disk, uint64_t lba, const uint8_t* buffer, uint32_t count){
+	size_t bytes = (size_t)count * VM_DISK_SECTOR;
+
+	assert(disk);
+	assert(buffer);
+
+	if(!vm_disk_range(disk, lba, count)){
+		return -1;
+	}
+
+	//压缩映像只读
+	if(disk->type == VM_DISK_COMPRESSED){
+		return -1;
+	} else if(disk->type == VM_DISK_DEDUP){
+		return vm_dedup_write(disk, lba, buffer, count);
+	} else if(disk->type != VM_DISK_RAW){
+		return vm_image_write(disk, lba, buffer, count);
+	}
+
+	if(disk->addr){
+		memcpy(disk->addr + lba * VM_DISK_SECTOR, buffer, bytes);
+		return vm_disk_sync(disk, lba, count);
+	}
+
+	if(pwrite(disk->fd, buffer, bytes, lba * VM_DISK_SECTOR) != (ssize_t)bytes){
+		return -1;
+	}
+
+	return vm_disk_sync(disk, lba, count);
+}
+
+int vm_disk_writev(struct vm_disk* disk, uint64_t lba, const struct iovec* iov, int iovcnt){
+	uint64_t bytes = 0;
+	int i = 0;
+
+	assert(disk);
+
+	for(i = 0; i < iovcnt; i++){
+		bytes += iov[i].iov_len;
+	}
+
+	uint32_t count = (uint32_t)(bytes / VM_DISK_SECTOR);
+	if(bytes % VM_DISK_SECTOR != 0 || !vm_disk_range(disk, lba, count)){
+		return -1;
+	}
+
+	//映射的映像也用一次pwritev写入, 共享映射与页缓存一致, 之后对整个范围同步一次
+	if(disk->type == VM_DISK_RAW){
+		if(pwritev(disk->fd, iov, iovcnt, lba * VM_DISK_SECTOR) != (ssize_t)bytes){
+			return -1;
+		}
+
+		return vm_disk_sync(disk, lba, count);
+	}
+
+	//overlay和稀疏映像按簇分配, 逐段写入
+	for(i = 0; i < iovcnt; i++){
+		uint32_t n = (uint32_t)(iov[i].iov_len / VM_DISK_SECTOR);
+
+		if(vm_disk_write(disk, lba, (const uint8_t*)iov[i].iov_base, n) < 0){
+			return -1;
+		}
+		lba += n;
+	}
+
+	return 0;
 }
 
-int vm_file_handle_read(struct vm_file_handle* handle, uint8_t* buf, uint32_t size){
-	assert(handle);
-	assert(buf);
-	assert(handle->fd > 0);
-	assert(size > 0);
+int vm_disk_sync(struct vm_disk* disk, uint64_t lba, uint32_t count){
+	assert(disk);
+
+	//overlay, 稀疏, 去重和未映射的映像通过pwrite写入, 同步模式下等待数据落盘
+	int direct = disk->type != VM_DISK_RAW || disk->addr == NULL;
+	if(disk->type == VM_DISK_COMPRESSED || (direct && disk->sync != VM_FILE_SYNC_SYNC)){
+		return 0;
+	} else if(direct){
+		return vm_disk_flush(disk);
+	}
 
-	return read(handle->fd, buf, size);
+	if((disk->sync != VM_FILE_SYNC_ASYNC && disk->sync != VM_FILE_SYNC_SYNC) || count == 0){
+		return 0;
+	}
+
+	//msync要求地址按页对齐
+	uint64_t offset = lba * VM_DISK_SECTOR;
+	uint64_t begin = offset & ~((uint64_t)getpagesize() - 1);
+
+	return msync(disk->addr + begin, offset + (uint64_t)count * VM_DISK_SECTOR - begin,
+			disk->sync == VM_FILE_SYNC_SYNC ? MS_SYNC : MS_ASYNC);
 }
 
-int vm_file_handle_write(struct vm_file_handle* handle, uint8_t* buf, uint32_t size){
-	assert(handle);
-	assert(buf);
-	assert(handle->fd > 0);
-	assert(size > 0);
+int vm_disk_flush(struct vm_disk* disk){
+	assert(disk);
+
+	if(disk->sync == VM_FILE_SYNC_NONE || disk->type == VM_DISK_COMPRESSED){
+		return 0;
+	}
+
+	if(disk->addr){
+		return msync(disk->addr, disk->size, MS_SYNC);
+	}
+
+	//去重映像的块先于分配表落盘
+	if(disk->store && vm_chunk_store_sync(disk->store) < 0){
+		return -1;
+	}
 
-	return write(handle->fd, buf, size);
+	return fdatasync(disk->fd);
 }
 
-void vm_file_handle_destroy(struct vm_file_handle* handle){
-	assert(handle);
-	assert(handle->fd > 0);
+int vm_disk_prefetch(struct vm_disk* disk, uint64_t lba, uint32_t count){
+	assert(disk);
 
-	close(handle->fd);
-	free(handle);
+	if(lba >= disk->sectors){
+		return 0;
+	}
+
+	if(count > disk->sectors - lba){
+		count = disk->sectors - lba;
+	}
+
+	//overlay的大部分数据在基础映像中, 稀疏映像不需要预读
+	if(disk->type == VM_DISK_OVERLAY){
+		return vm_disk_prefetch(disk->base, lba, count);
+	} else if(disk->type == VM_DISK_SPARSE || disk->type == VM_DISK_DEDUP){
+		return 0;
+	} else if(disk->type == VM_DISK_COMPRESSED){
+		if(count == 0){
+			return 0;
+		}
+
+		//只预读压缩后的数据
+		uint32_t first = (uint32_t)(lba / VM_COMPRESS_CHUNK_SECTORS);
+		uint32_t last = (uint32_t)((lba + count - 1) / VM_COMPRESS_CHUNK_SECTORS);
+		return posix_fadvise(disk->fd, disk->index[first], disk->index[last + 1] - disk->index[first], POSIX_FADV_WILLNEED);
+	}
+
+	uint64_t offset = lba * VM_DISK_SECTOR;
+	uint64_t bytes = (uint64_t)count * VM_DISK_SECTOR;
+
+	if(disk->addr){
+		uint64_t begin = offset & ~((uint64_t)getpagesize() - 1);
+		return madvise(disk->addr + begin, offset + bytes - begin, MADV_WILLNEED);
+	}
+
+	return posix_fadvise(disk->fd, offset, bytes, POSIX_FADV_WILLNEED);
 }
 
-int vm_file_handle_seek(struct vm_file_handle* handle, uint64_t seek){
-	assert(handle);
-	assert(handle->fd > 0);
+void vm_disk_close(struct vm_disk* disk){
+	assert(disk);
+
+	if(disk->addr){
+		msync(disk->addr, disk->size, MS_SYNC);
+		munmap(disk->addr, disk->size);
+	}
+
+	if(disk->store){
+		vm_chunk_store_sync(disk->store);
+		vm_chunk_store_close(disk->store);
+	}
+
+	if(disk->type == VM_DISK_OVERLAY || disk->type == VM_DISK_SPARSE || disk->type == VM_DISK_DEDUP){
+		fdatasync(disk->fd);
+	}
+
+	if(disk->base){
+		vm_disk_close(disk->base);
+	}
 
-	return lseek(handle->fd, seek, SEEK_SET);
+	free(disk->table);
+	free(disk->index);
+	free(disk->chunks);
+	pthread_mutex_destroy(&disk->mutex);
+	close(disk->fd);
+	free(disk);
 }
@@ -2,17 +2,133 @@
 #define VM_UTIL_FILE_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
-struct vm_file_handle{
+#define VM_DISK_SECTOR 512
+
+#define VM_FILE_SYNC_NONE	0	//写入后不主动回写, 也不响应刷新(unsafe)
+#define VM_FILE_SYNC_ASYNC	1	//写入后异步回写(MS_ASYNC)
+#define VM_FILE_SYNC_SYNC	2	//写入后同步回写(MS_SYNC)
+#define VM_FILE_SYNC_FLUSH	3	//只在guest刷新缓存, 挂起和退出时落盘
+#define VM_FILE_SYNC_PERIODIC	4	//在FLUSH的基础上定期落盘
+
+#define VM_DISK_RAW			0	//扇区按顺序存放的原始映像
+#define VM_DISK_OVERLAY		1	//只读基础映像加上只保存修改过的簇的差异文件
+#define VM_DISK_SPARSE		2	//只保存写入过的簇的稀疏映像
+#define VM_DISK_COMPRESSED	3	//按块压缩的只读映像
+#define VM_DISK_DEDUP		4	//簇映射到共享块存储的去重映像
+
+/*
+ * overlay差异文件和稀疏映像使用相同的格式:
+ *     头部        vm_image_header, 占一个扇区
+ *     分配表      每簇一个uint32_t, 0表示未分配, 否则为数据区中的簇号(从1开始)
+ *     数据区      分配的簇, 按分配顺序追加
+ * 未分配的簇在overlay中读基础映像, 在稀疏映像中读出全0
+ * 新建映像只写入头部, 分配表是文件空洞
+ */
+#define VM_OVERLAY_MAGIC			"VMOVRLY1"
+#define VM_SPARSE_MAGIC				"VMSPARS1"
+#define VM_IMAGE_CLUSTER_SECTORS	8	//每簇8个扇区(4KiB)
+
+struct vm_image_header{
+	char magic[8];
+	uint64_t sectors;			//虚拟磁盘的扇区数, overlay与基础映像相同
+	uint32_t cluster_sectors;
+	uint32_t clusters;			//分配表项数
+	uint32_t table_offset;		//分配表在文件中的偏移(字节)
+	uint32_t data_offset;		//数据区在文件中的偏移(字节)
+	char base[256];				//overlay基础映像的绝对路径
+};
+
+/*
+ * 压缩映像同样以vm_image_header开头, cluster_sectors为块大小:
+ *     索引        clusters + 1个uint64_t, 第i块的数据位于[index[i], index[i + 1])
+ *     数据区      每块独立用util_lz压缩, 压缩后不变小的块原样保存
+ * 只读, 适合作为overlay的基础映像分发
+ */
+#define VM_COMPRESS_MAGIC			"VMCOMPR1"
+#define VM_COMPRESS_CHUNK_SECTORS	64	//每块64个扇区(32KiB)
+#define VM_COMPRESS_CACHE_CHUNKS	16	//缓存解压后的块数, 直接映射
+
+/*
+ * 去重映像同样以vm_image_header开头, base为共享块存储的路径, 分配表项为存储中的块号
+ * 块存储由多个guest共享, 只追加不修改:
+ *     store        第i块(4KiB, 与簇大小相同)位于i * 4KiB, 第0块为头部
+ *     store.hash   第i块内容的64位哈希位于i * 8, 文件长度决定块数
+ * 写入簇时按哈希查找相同内容的块, 比较内容确认后共用, 否则追加新块
+ * 全0的簇不占用块, 追加时用flock与其他进程互斥, 不再使用的块不回收
+ */
+#define VM_DEDUP_MAGIC				"VMDEDUP1"
+#define VM_CHUNK_STORE_MAGIC		"VMCHUNK1"
+
+struct vm_chunk_store;
+
+struct vm_disk_chunk{
+	uint32_t chunk;		//块号+1, 0表示空
+	uint8_t data[VM_COMPRESS_CHUNK_SECTORS * VM_DISK_SECTOR];
+};
+
+/*
+ * 每块磁盘一个长期持有的I/O上下文, 在磁盘初始化时打开并校验映像,
+ * 映像可以mmap时读写扇区只需内存复制, 否则使用pread/pwrite, 每次传输最多一次系统调用
+ */
+struct vm_disk{
 	int fd;
+	int type;			//VM_DISK_*
+	uint64_t size;		//映像大小(字节)
+	uint64_t sectors;	//扇区数
+	uint8_t* addr;		//映像的内存映射, 无法映射或不是原始映像时为NULL
+	int sync;			//回写策略
+
+	//overlay和稀疏映像
+	struct vm_disk* base;	//overlay只读的基础映像
+	uint32_t* table;		//分配表
+	uint32_t clusters;
+	uint32_t allocated;		//已分配的簇数
+	uint64_t table_offset;
+	uint64_t data_offset;
+	pthread_mutex_t mutex;	//簇的分配, 压缩块的解压
+
+	//压缩映像
+	uint64_t* index;				//块在文件中的偏移
+	struct vm_disk_chunk* chunks;	//解压后的块
+
+	//去重映像
+	struct vm_chunk_store* store;
 };
 
-struct vm_file_handle* vm_file_handle_create(void);
+//打开磁盘映像, 根据文件头识别格式
+struct vm_disk* vm_disk_open(const char* path, int sync);
+
+//以base为基础映像新建overlay差异文件, path已存在时失败, 成功返回0
+int vm_disk_overlay_create(const char* path, const char* base);
+//新建sectors个扇区的稀疏映像, path已存在时失败, 成功返回0
+int vm_disk_sparse_create(const char* path, uint64_t sectors);
+//把原始映像raw压缩为path, path已存在时失败, 成功返回0
+int vm_disk_compress_create(const char* path, const char* raw);
+//新建sectors个扇区, 使用块存储store的去重映像, store不存在时在打开时创建
+int vm_disk_dedup_create(const char* path, const char* store, uint64_t sectors);
+//去重映像共享块存储中的块数
+uint32_t vm_disk_dedup_chunks(struct vm_disk* disk);
+
+//获取[lba, lba + count)在映射中的地址, 未映射或越界时返回NULL
+uint8_t* vm_disk_addr(struct vm_disk* disk, uint64_t lba, uint32_t count);
+
+//读写count个扇区, 成功返回0
+int vm_disk_read(struct vm_disk* disk, uint64_t lba, uint8_t* buffer, uint32_t count);
+int vm_disk_write(struct vm_disk* disk, uint64_t lba, const uint8_t* buffer, uint32_t count);
+//把iovcnt段连续的数据从lba开始写入, 每段为整数个扇区, 原始映像一次pwritev
+int vm_disk_writev(struct vm_disk* disk, uint64_t lba, const struct iovec* iov, int iovcnt);
+
+//通过映射地址写入之后按回写策略同步
+int vm_disk_sync(struct vm_disk* disk, uint64_t lba, uint32_t count);
+//等待已写入的数据落盘, VM_FILE_SYNC_NONE时不做任何事
+int vm_disk_flush(struct vm_disk* disk);
 
-int vm_file_handle_seek(struct vm_file_handle* handle, uint64_t seek);
-int vm_file_handle_read(struct vm_file_handle* handle,uint8_t* buffer, uint32_t size);
-int vm_file_handle_write(struct vm_file_handle* handle,uint8_t* buffer, uint32_t size);
+//提示内核预读[lba, lba + count), 不等待数据就绪
+int vm_disk_prefetch(struct vm_disk* disk, uint64_t lba, uint32_t count);
 
-void vm_file_handle_destroy(struct vm_file_handle* handle);
+void vm_disk_close(struct vm_disk* disk);
 
 #endif
@@ -0,0 +1,170 @@
+#include <string.h>
+#include "util/util_lz.h"
+
+#define LZ_MIN_MATCH 	4
+#define LZ_MAX_OFFSET	65535
+#define LZ_HASH_BITS 	12
+
+static inline uint32_t lz_read32(const uint8_t* p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v){
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//写入长度的扩展部分
+static int lz_write_length(uint8_t* dst, uint32_t* op, uint32_t cap, uint32_t n){
+	while(n >= 255){
+		if(*op >= cap) return -1;
+		dst[(*op)++] = 255;
+		n -= 255;
+	}
+
+	if(*op >= cap) return -1;
+	dst[(*op)++] = (uint8_t)n;
+
+	return 0;
+}
+
+/*
+ * 输出一个序列, mlen为0表示最后一个只包含字面量的序列
+ */
+static int lz_write_sequence(uint8_t* dst, uint32_t* op, uint32_t cap,
+		const uint8_t* literals, uint32_t llen, uint32_t offset, uint32_t mlen){
+	uint32_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+	uint8_t token = (uint8_t)(((llen < 15 ? llen : 15) << 4) | (mcode < 15 ? mcode : 15));
+
+	if(*op >= cap) return -1;
+	dst[(*op)++] = token;
+
+	if(llen >= 15 && lz_write_length(dst, op, cap, llen - 15) < 0){
+		return -1;
+	}
+
+	if(*op + llen > cap) return -1;
+	memcpy(dst + *op, literals, llen);
+	*op += llen;
+
+	if(mlen == 0){
+		return 0;
+	}
+
+	if(*op + 2 > cap) return -1;
+	dst[(*op)++] = (uint8_t)offset;
+	dst[(*op)++] = (uint8_t)(offset >> 8);
+
+	if(mcode >= 15 && lz_write_length(dst, op, cap, mcode - 15) < 0){
+		return -1;
+	}
+
+	return 0;
+}
+
+int vm_lz_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap){
+	uint32_t table[1 << LZ_HASH_BITS];	//保存位置+1, 0表示空
+	uint32_t ip = 0;
+	uint32_t anchor = 0;
+	uint32_t op = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while(ip + LZ_MIN_MATCH <= len){
+		uint32_t seq = lz_read32(src + ip);
+		uint32_t h = lz_hash(seq);
+		uint32_t ref = table[h];
+
+		table[h] = ip + 1;
+
+		if(ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != seq){
+			ip++;
+			continue;
+		}
+
+		ref--;
+
+		uint32_t mlen = LZ_MIN_MATCH;
+		while(ip + mlen < len && src[ref + mlen] == src[ip + mlen]){
+			mlen++;
+		}
+
+		if(lz_write_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - ref, mlen) < 0){
+			return -1;
+		}
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	if(lz_write_sequence(dst, &op, cap, src + anchor, len - anchor, 0, 0) < 0){
+		return -1;
+	}
+
+	return (int)op;
+}
+
+//读取长度的扩展部分
+static int lz_read_length(const uint8_t* src, uint32_t len, uint32_t* ip, uint32_t* n){
+	uint8_t b = 0;
+
+	do{
+		if(*ip >= len) return -1;
+		b = src[(*ip)++];
+		*n += b;
+	} while(b == 255);
+
+	return 0;
+}
+
+int vm_lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap){
+	uint32_t ip = 0;
+	uint32_t op = 0;
+
+	while(ip < len){
+		uint8_t token = src[ip++];
+		uint32_t llen = token >> 4;
+		uint32_t mlen = token & 0x0f;
+
+		if(llen == 15 && lz_read_length(src, len, &ip, &llen) < 0){
+			return -1;
+		}
+
+		if(ip + llen > len || op + llen > cap){
+			return -1;
+		}
+		memcpy(dst + op, src + ip, llen);
+		ip += llen;
+		op += llen;
+
+		//最后一个序列
+		if(ip == len){
+			break;
+		}
+
+		if(ip + 2 > len){
+			return -1;
+		}
+
+		uint32_t offset = (uint32_t)src[ip] | ((uint32_t)src[ip + 1] << 8);
+		ip += 2;
+
+		if(mlen == 15 && lz_read_length(src, len, &ip, &mlen) < 0){
+			return -1;
+		}
+		mlen += LZ_MIN_MATCH;
+
+		if(offset == 0 || offset > op || op + mlen > cap){
+			return -1;
+		}
+
+		//匹配区域可能与输出重叠, 逐字节复制
+		uint32_t i = 0;
+		for(; i < mlen; i++, op++){
+			dst[op] = dst[op - offset];
+		}
+	}
+
+	return (int)op;
+}
@@ -0,0 +1,18 @@
+#ifndef VM_UTIL_LZ_H
+#define VM_UTIL_LZ_H
+
+#include <stdint.h>
+
+/*
+ * 简单快速的LZ77压缩, 格式为若干序列:
+ *     token     高4位为字面量长度, 低4位为匹配长度-4, 值为15时后续字节继续累加
+ *     literals  字面量
+ *     offset    2字节匹配距离, 最后一个序列只有字面量
+ */
+
+//压缩, 返回压缩后的大小, 超出cap时返回-1
+int vm_lz_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap);
+//解压, 返回解压后的大小, 数据错误或超出cap时返回-1
+int vm_lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap);
+
+#endif
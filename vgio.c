@@ -1,11 +1,16 @@
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "vgio.h"
 #include "mem.h"
 #include "config.h"
@@ -51,6 +56,209 @@ void vgio_init(void){
 	//vgio_cursor_fgcolor(VGIO_COLOR_FG_WHITE);
 }
 
+//本进程映射的共享内存, 退出时删除
+static int g_vgio_shm_id = -1;
+
+struct vgio_shm* vgio_shm_attach(void){
+	int id = shmget(SHM_SCREEN_KEY, sizeof(struct vgio_shm), IPC_CREAT | 0600);
+
+	//旧版本留下的共享内存大小不同, 删除后重新创建
+	if(id < 0 && errno == EINVAL){
+		int stale = shmget(SHM_SCREEN_KEY, 0, 0);
+		if(stale >= 0 && shmctl(stale, IPC_RMID, NULL) == 0){
+			id = shmget(SHM_SCREEN_KEY, sizeof(struct vgio_shm), IPC_CREAT | 0600);
+		}
+	}
+
+	if(id < 0){
+		perror("shmget screen failed ");
+		return NULL;
+	}
+
+	struct vgio_shm* shm = (struct vgio_shm*)shmat(id, NULL, 0);
+	if(shm == (void*)-1){
+		perror("shmat screen failed ");
+		return NULL;
+	}
+
+	//新建的共享内存全为0, 由先映射的一方填写头部, 旧版本的内容全部清除
+	if(shm->magic != VGIO_SHM_MAGIC){
+		memset(shm, 0, sizeof(struct vgio_shm));
+		shm->width = VGIO_WIDTH;
+		shm->height = VGIO_HEGIHT;
+		__atomic_store_n(&shm->magic, VGIO_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	g_vgio_shm_id = id;
+
+	return shm;
+}
+
+void vgio_shm_remove(void){
+	//另一方已经删除时失败, 忽略
+	if(g_vgio_shm_id >= 0){
+		shmctl(g_vgio_shm_id, IPC_RMID, NULL);
+		g_vgio_shm_id = -1;
+	}
+}
+
+static long vgio_futex(uint32_t* addr, int op, uint32_t val){
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+void vgio_shm_commit(struct vgio_shm* shm){
+	//seq的写入与waiters的读取不能重排, 否则会漏掉唤醒
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&shm->waiters, __ATOMIC_SEQ_CST) &&
+			__atomic_exchange_n(&shm->waiters, 0, __ATOMIC_SEQ_CST)){
+		vgio_futex(&shm->seq, FUTEX_WAKE, INT_MAX);
+	}
+}
+
+uint32_t vgio_shm_wait(struct vgio_shm* shm, uint32_t seq){
+	uint32_t now = 0;
+
+	while(1){
+		__atomic_store_n(&shm->waiters, 1, __ATOMIC_SEQ_CST);
+
+		now = __atomic_load_n(&shm->seq, __ATOMIC_SEQ_CST);
+		if(now != seq){
+			break;
+		}
+
+		//seq已经变化时立即返回EAGAIN
+		vgio_futex(&shm->seq, FUTEX_WAIT, seq);
+	}
+
+	__atomic_store_n(&shm->waiters, 0, __ATOMIC_RELAXED);
+
+	return now;
+}
+
+static uint32_t vgio_put_varint(uint8_t* p, uint32_t v){
+	uint32_t n = 0;
+
+	while(v >= 0x80){
+		p[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+
+	return n;
+}
+
+//返回消耗的长度, 数据不完整返回0, 超过32位返回-1
+static int vgio_get_varint(const uint8_t* p, uint32_t length, uint32_t* v){
+	uint32_t n = 0;
+	uint32_t shift = 0;
+
+	*v = 0;
+	while(n < length){
+		uint8_t b = p[n++];
+
+		*v |= (uint32_t)(b & 0x7f) << shift;
+		if(!(b & 0x80)){
+			return (int)n;
+		}
+
+		shift += 7;
+		if(shift >= 32){
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+uint32_t vgio_encode(uint8_t* buffer, const struct vgio_command* vc){
+	uint32_t n = 0;
+
+	buffer[n++] = (uint8_t)vc->command;
+
+	switch(vc->command){
+	case VGIO_COMMAND_SET_CURSOR:
+		n += vgio_put_varint(buffer + n, (uint32_t)vc->pixel.x);
+		n += vgio_put_varint(buffer + n, (uint32_t)vc->pixel.y);
+		break;
+	case VGIO_COMMAND_SET_FG:
+		n += vgio_put_varint(buffer + n, (uint32_t)vc->pixel.fgcolor);
+		break;
+	case VGIO_COMMAND_SET_BG:
+		n += vgio_put_varint(buffer + n, (uint32_t)vc->pixel.bgcolor);
+		break;
+	case VGIO_COMMAND_SET_CHAR:
+		n += vgio_put_varint(buffer + n, vc->span.offset);
+		n += vgio_put_varint(buffer + n, vc->span.count);
+		break;
+	default:
+		break;
+	}
+
+	return n;
+}
+
+int vgio_decode(const uint8_t* buffer, uint32_t length, struct vgio_command* vc){
+	uint32_t args[2] = {0, 0};
+	uint32_t nargs = 0;
+	uint32_t n = 1;
+	uint32_t i = 0;
+
+	if(length == 0){
+		return 0;
+	}
+
+	vc->command = buffer[0];
+
+	switch(vc->command){
+	case VGIO_COMMAND_SET_CURSOR:
+	case VGIO_COMMAND_SET_CHAR:
+		nargs = 2;
+		break;
+	case VGIO_COMMAND_SET_FG:
+	case VGIO_COMMAND_SET_BG:
+		nargs = 1;
+		break;
+	default:
+		return -1;
+	}
+
+	for(; i < nargs; i++){
+		int r = vgio_get_varint(buffer + n, length - n, &args[i]);
+		if(r <= 0){
+			return r;
+		}
+		n += r;
+	}
+
+	switch(vc->command){
+	case VGIO_COMMAND_SET_CURSOR:
+		vc->pixel.x = (int)args[0];
+		vc->pixel.y = (int)args[1];
+		break;
+	case VGIO_COMMAND_SET_FG:
+		vc->pixel.fgcolor = (int)args[0];
+		break;
+	case VGIO_COMMAND_SET_BG:
+		vc->pixel.bgcolor = (int)args[0];
+		break;
+	case VGIO_COMMAND_SET_CHAR:
+		if(args[1] > VGIO_SPAN_MAX){
+			return -1;
+		}
+		if(length - n < args[1] * 2){
+			return 0;
+		}
+		vc->span.offset = args[0];
+		vc->span.count = args[1];
+		vc->span.cells = buffer + n;
+		n += args[1] * 2;
+		break;
+	}
+
+	return (int)n;
+}
+
 static void vgio_clear(void){
 	printf("\033[2J");
 }
@@ -1,6 +1,8 @@
 #ifndef VM_VGIO_H
 #define VM_VGIO_H
 
+#include <stdint.h>
+
 #define VGIO_WIDTH 	80
 #define VGIO_HEGIHT 25
 
@@ -12,14 +14,57 @@
 #define VGIO_COMMAND_SET_FG     4  //设置前景色
 #define VGIO_COMMAND_SET_BG     5  //设置背景色
 #define VGIO_COMMAND_SET_CHAR   6
-#define VGIO_COMMAND_GET_CHAR   7
+//#define VGIO_COMMAND_GET_CHAR   7  //vm直接读取guest内存, vgio_cli不再应答
 
 
 
 #define SHM_SCREEN_KEY 0x13141516
 #define VGIO_UNIX_SOCKET "/var/run/.vgio_unix.sock"
 
-//命令交互格式
+/*
+ * 文本缓冲区通过共享内存(SHM_SCREEN_KEY)发布给vgio_cli:
+ *     text   与0xb8000 - 0xbffff布局相同, 每个字符占两字节(字符, 属性),
+ *            每页80x25个字符, 页间隔4KiB, 共8页
+ *     seq    vm每次修改text或光标之后加1, vgio_cli发现变化后重绘
+ * vm是唯一的写者, 写入只是内存操作, 不需要系统调用
+ * vgio_cli没有新内容可画时置waiters并在seq上futex等待,
+ * vm只在waiters被置位时唤醒一次, 画面持续变化时每帧最多一次唤醒
+ * 布局改变时修改magic, 旧版本留下的共享内存会被重新初始化或删除
+ * vm和vgio_cli退出时都会删除共享内存, 已映射的一方仍可继续使用到退出
+ */
+#define VGIO_SHM_MAGIC		0x32494756	//"VGI2"
+#define VGIO_PAGE_SIZE		4096
+#define VGIO_PAGES			8
+#define VGIO_TEXT_SIZE		(VGIO_PAGE_SIZE * VGIO_PAGES)
+
+struct vgio_shm{
+	uint32_t magic;
+	uint32_t seq;			//修改序号, 同时作为futex
+	uint32_t waiters;		//vgio_cli正在等待seq变化
+	uint8_t cursor_x;		//光标位置
+	uint8_t cursor_y;
+	uint8_t page;			//当前显示页
+	uint8_t reserved;
+	uint32_t width;
+	uint32_t height;
+	uint8_t text[VGIO_TEXT_SIZE];
+};
+
+/*
+ * socket上的命令使用变长编码, 由vgui按帧批量发送, vgio_cli只接收不回复:
+ *     command   1字节, VGIO_COMMAND_*
+ *     参数      每个整数为varint(每字节低7位, 最高位表示后面还有字节)
+ *         SET_CURSOR   x, y
+ *         SET_FG       fgcolor
+ *         SET_BG       bgcolor
+ *         SET_CHAR     offset, count, 之后是count个(字符, 属性)
+ * SET_CHAR把连续的字符合并为一段, offset为第一个字符在文本缓冲区中的序号,
+ * 只在无法使用共享内存时发送
+ */
+#define VGIO_COMMAND_MAX	16		//命令头部的最大长度
+#define VGIO_SPAN_MAX		1024	//一段SET_CHAR的最大字符数
+
+//解码后的命令
 struct vgio_command{
 	int command;
 	struct {
@@ -29,11 +74,30 @@ struct vgio_command{
 		int fgcolor;
 		char c;
 	} pixel;
+	struct {
+		uint32_t offset;
+		uint32_t count;
+		const uint8_t* cells;
+	} span;
 };
 
+//编码命令头部, 返回长度, SET_CHAR的字符由调用者随后追加
+uint32_t vgio_encode(uint8_t* buffer, const struct vgio_command* vc);
+//从buffer解码一条完整的命令, 返回消耗的长度, 数据不完整返回0, 格式错误返回-1
+int vgio_decode(const uint8_t* buffer, uint32_t length, struct vgio_command* vc);
+
 //初始化vgio环境，创建vgio输出窗口
 void vgio_init(void);
 
+//映射共享的文本缓冲区, 不存在时创建, 失败返回NULL
+struct vgio_shm* vgio_shm_attach(void);
+//标记删除共享内存, 已有的映射在解除或进程退出前仍然有效
+void vgio_shm_remove(void);
+//修改之后增加seq, 有等待者时唤醒, 只能由唯一的写者调用
+void vgio_shm_commit(struct vgio_shm* shm);
+//等待seq不再等于seq, 返回新的值
+uint32_t vgio_shm_wait(struct vgio_shm* shm, uint32_t seq);
+
 //保存光标位置
 void vgio_cursor_push(void);
 //恢复光标位置
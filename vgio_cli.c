@@ -1,12 +1,19 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "vgio.h"
 #include "mem.h"
 #include "config.h"
@@ -17,55 +24,237 @@
 	#define LOG
 #endif
 
-//屏幕显示
-char g_vgio_screen[VGIO_HEGIHT][VGIO_WIDTH] = {0};
+//vm共享的文本缓冲区
+struct vgio_shm* g_vgio_shm = NULL;
+//共享内存不可用, g_vgio_shm为本地缓冲区, 由socket命令更新
+int g_vgio_private = 0;
 
 extern void vgio_cursor_set(int x, int y);
 
+//屏幕上(x, y)处字符在共享内存中的位置
+static inline uint8_t* vgio_cell(int x, int y){
+	uint32_t offset = g_vgio_shm->page * VGIO_PAGE_SIZE + (y * VGIO_WIDTH + x) * 2;
+
+	return &g_vgio_shm->text[offset % VGIO_TEXT_SIZE];
+}
+
+/*
+ * 差异渲染: 保存上一帧画到终端上的内容, 只输出变化的字符,
+ * 光标定位和颜色只在需要时输出, 每帧的输出合并为一次write
+ */
+#define VGIO_ROW_BYTES		(VGIO_WIDTH * 2)
+#define VGIO_FRAME_BYTES	(VGIO_ROW_BYTES * VGIO_HEGIHT)
+#define VGIO_OUT_SIZE		65536
+#define VGIO_SKIP_CELLS		4	//间隔不超过4个字符时重画中间的字符, 比定位光标短
+#define VGIO_FPS_DEFAULT	30	//默认最大帧率
+
+struct vgio_render{
+	uint8_t frame[VGIO_FRAME_BYTES];	//终端上当前的内容
+	int valid;				//frame有效, 否则整屏重画
+	int attr;				//终端当前的颜色属性, -1表示未知
+	int x;					//终端光标位置, 输出字符后随之移动
+	int y;
+	char out[VGIO_OUT_SIZE];
+	uint32_t length;
+};
+
+static struct vgio_render g_vgio_render = {.attr = -1};
+
+//文本属性的颜色顺序(蓝绿红)与ANSI(红绿蓝)相反
+static const uint8_t g_vgio_ansi_color[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+
+static void vgio_out(struct vgio_render* r, const char* fmt, ...){
+	va_list ap;
+
+	va_start(ap, fmt);
+	r->length += vsnprintf(r->out + r->length, VGIO_OUT_SIZE - r->length, fmt, ap);
+	va_end(ap);
+}
+
+static void vgio_out_cell(struct vgio_render* r, uint8_t c, uint8_t attr){
+	if(r->attr != attr){
+		//高亮前景用90-97, 背景的高位是闪烁, 忽略
+		vgio_out(r, "\033[0;%d;%dm",
+				((attr & 0x08) ? 90 : 30) + g_vgio_ansi_color[attr & 0x07],
+				40 + g_vgio_ansi_color[(attr >> 4) & 0x07]);
+		r->attr = attr;
+	}
+
+	r->out[r->length++] = (c >= 0x20 && c < 0x7f) ? (char)c : ' ';
+	r->x++;
+}
+
+//一行中是否有变化, 16字节一组比较
+static inline int vgio_row_dirty(const uint8_t* cur, const uint8_t* prev){
+#ifdef __SSE2__
+	int i = 0;
+
+	for(; i < VGIO_ROW_BYTES; i += 16){
+		__m128i a = _mm_loadu_si128((const __m128i*)(cur + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff){
+			return 1;
+		}
+	}
+
+	return 0;
+#else
+	return memcmp(cur, prev, VGIO_ROW_BYTES) != 0;
+#endif
+}
+
+static void vgio_render_row(struct vgio_render* r, const uint8_t* cur, int y){
+	uint8_t* prev = r->frame + y * VGIO_ROW_BYTES;
+	int x = 0;
+
+	for(; x < VGIO_WIDTH; x++){
+		if(cur[x * 2] == prev[x * 2] && cur[x * 2 + 1] == prev[x * 2 + 1]){
+			continue;
+		}
+
+		//终端光标就在前面不远处时直接重画中间的字符
+		if(r->y == y && r->x <= x && x - r->x <= VGIO_SKIP_CELLS){
+			while(r->x < x){
+				vgio_out_cell(r, cur[r->x * 2], cur[r->x * 2 + 1]);
+			}
+		} else {
+			vgio_out(r, "\033[%d;%dH", y + 1, x + 1);
+			r->x = x;
+			r->y = y;
+		}
+
+		vgio_out_cell(r, cur[x * 2], cur[x * 2 + 1]);
+	}
+
+	memcpy(prev, cur, VGIO_ROW_BYTES);
+}
+
+//画出当前页与上一帧的差异
 static void vgio_flush(void){
-	int i = 0, j = 0;
+	struct vgio_render* r = &g_vgio_render;
+	uint8_t cur[VGIO_FRAME_BYTES];
+	int y = 0;
+
+	memcpy(cur, vgio_cell(0, 0), VGIO_FRAME_BYTES);
 
-	vgio_cursor_set(0, 0);
+	r->length = 0;
+	for(; y < VGIO_HEGIHT; y++){
+		const uint8_t* row = cur + y * VGIO_ROW_BYTES;
 
-	for ( ; i < VGIO_HEGIHT; i++){
-		for(j = 0; j < VGIO_WIDTH; j++){
-			printf("%c",g_vgio_screen[i][j]);
+		if(!r->valid){
+			//与现有内容逐字节取反, 保证每个字符都输出
+			uint32_t i = 0;
+			for(; i < VGIO_ROW_BYTES; i++){
+				r->frame[y * VGIO_ROW_BYTES + i] = ~row[i];
+			}
+		} else if(!vgio_row_dirty(row, r->frame + y * VGIO_ROW_BYTES)){
+			continue;
 		}
-		printf("\n");
+
+		vgio_render_row(r, row, y);
 	}
+	r->valid = 1;
+
+	//终端光标停在guest的光标处
+	if(r->length != 0 || r->x != g_vgio_shm->cursor_x || r->y != g_vgio_shm->cursor_y){
+		r->x = g_vgio_shm->cursor_x;
+		r->y = g_vgio_shm->cursor_y;
+		vgio_out(r, "\033[%d;%dH", r->y + 1, r->x + 1);
+	}
+
+	//vgio_init等用printf输出的内容先发出
+	fflush(stdout);
+
+	uint32_t done = 0;
+	while(done < r->length){
+		ssize_t n = write(STDOUT_FILENO, r->out + done, r->length - done);
+		if(n <= 0){
+			break;
+		}
+		done += (uint32_t)n;
+	}
+}
+
+//两帧之间的最小间隔, 由-f指定最大帧率
+uint64_t g_vgio_frame_ns = 1000000000ull / VGIO_FPS_DEFAULT;
+//主线程要求刷新线程退出, 之后由主线程独占g_vgio_render
+static int g_vgio_stop = 0;
+
+static uint64_t vgio_now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
+/*
+ * 画面没有变化时阻塞在seq上, 不会被唤醒
+ * 发现变化后等到距上一帧满一个帧间隔再画, 期间的修改合并为一帧
+ */
 void * thread_flush_screen(void * arg){
+	uint32_t seq = __atomic_load_n(&g_vgio_shm->seq, __ATOMIC_ACQUIRE);
+	uint64_t last = vgio_now_ns();
+
+	vgio_flush();
+
 	while(1){
+		vgio_shm_wait(g_vgio_shm, seq);
+		if(__atomic_load_n(&g_vgio_stop, __ATOMIC_ACQUIRE)){
+			break;
+		}
+
+		uint64_t next = last + g_vgio_frame_ns;
+		if(vgio_now_ns() < next){
+			struct timespec ts = {
+				.tv_sec = next / 1000000000ull,
+				.tv_nsec = next % 1000000000ull,
+			};
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+				;
+			}
+		}
+
+		//先取seq再画, 绘制期间的修改留给下一帧
+		seq = __atomic_load_n(&g_vgio_shm->seq, __ATOMIC_ACQUIRE);
+		last = vgio_now_ns();
 		vgio_flush();
-		usleep(500000);
 	}
 
 	return NULL;
 }
 
-static void command_proc(int sockfd, struct vgio_command * vc){
+static void command_proc(struct vgio_command * vc){
 	switch(vc->command){
 	case VGIO_COMMAND_SET_CURSOR:
+		//终端的光标由渲染线程按共享内存中的位置设置
 		LOG("command: set-cursor, x %d, y %d\n",vc->pixel.x, vc->pixel.y);
-		vgio_cursor_set(vc->pixel.y, vc->pixel.x);
-		break;
-	case VGIO_COMMAND_GET_CHAR:
-		LOG("command: get-char, x %d, y %d\n",vc->pixel.x, vc->pixel.y);
-		vgio_cursor_set(vc->pixel.y, vc->pixel.x);
-		write(sockfd, &g_vgio_screen[vc->pixel.y][vc->pixel.x], 1);
+		if(g_vgio_private){
+			g_vgio_shm->cursor_x = (uint8_t)vc->pixel.x;
+			g_vgio_shm->cursor_y = (uint8_t)vc->pixel.y;
+			vgio_shm_commit(g_vgio_shm);
+		}
 		break;
 	case VGIO_COMMAND_SET_FG:
+		//颜色已经包含在每个字符的属性中
 		LOG("command: set-fg, fd %d\n",vc->pixel.fgcolor);
-		vgio_cursor_fgcolor(vc->pixel.fgcolor);
 		break;
 	case VGIO_COMMAND_SET_BG:
 		LOG("command: set-bg, fd %d\n",vc->pixel.bgcolor);
-		vgio_cursor_bkcolor(vc->pixel.bgcolor);
 		break;
 	case VGIO_COMMAND_SET_CHAR:
-		LOG("command: set-char, x %d, y %d, c %c\n",vc->pixel.x, vc->pixel.y, vc->pixel.c);
-		g_vgio_screen[vc->pixel.y][vc->pixel.x] = vc->pixel.c;
+		//只在vm无法使用共享内存时收到, 此时g_vgio_shm为本地缓冲区
+		LOG("command: set-char, offset %u, count %u\n", vc->span.offset, vc->span.count);
+		if(vc->span.offset < VGIO_TEXT_SIZE / 2){
+			uint32_t count = vc->span.count;
+
+			if(count > VGIO_TEXT_SIZE / 2 - vc->span.offset){
+				count = VGIO_TEXT_SIZE / 2 - vc->span.offset;
+			}
+			memcpy(&g_vgio_shm->text[vc->span.offset * 2], vc->span.cells, count * 2);
+			vgio_shm_commit(g_vgio_shm);
+		}
 		break;
 	default:
 		break;
@@ -74,12 +263,38 @@ static void command_proc(int sockfd, struct vgio_command * vc){
 
 
 
-int main(){
+int main(int argc, char* argv[]){
 	int fd = 0;
+	int opt = 0;
 	pthread_t pid = 0;
 
+	while((opt = getopt(argc, argv, "f:")) != -1){
+		switch(opt){
+		case 'f':	//最大帧率
+			if(atoi(optarg) <= 0){
+				fprintf(stderr, "usage: %s [-f fps]\n", argv[0]);
+				return -1;
+			}
+			g_vgio_frame_ns = 1000000000ull / atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-f fps]\n", argv[0]);
+			return -1;
+		}
+	}
+
 	vgio_init();
 
+	//无法使用共享内存时由vm通过socket发送文本
+	g_vgio_shm = vgio_shm_attach();
+	if(g_vgio_shm == NULL){
+		g_vgio_shm = (struct vgio_shm*)calloc(1, sizeof(struct vgio_shm));
+		if(g_vgio_shm == NULL){
+			return -1;
+		}
+		g_vgio_private = 1;
+	}
+
 	unlink(VGIO_UNIX_SOCKET);
 
 	fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -104,7 +319,9 @@ int main(){
 	struct sockaddr_un c_addr;
 	int c_len = sizeof(c_addr);
 
-	struct vgio_command vc = {0};
+	struct vgio_command vc;
+	uint8_t buffer[4096];
+	uint32_t length = 0;
 
 	if(pthread_create(&pid, NULL, thread_flush_screen, NULL) != 0){
 		fprintf(stderr, "thread create failed");
@@ -114,20 +331,48 @@ int main(){
 	c_sock = accept(fd, (struct sockaddr*)&c_addr, &c_len);
 
 	while(1){
-		/*reset command*/
-		vc.command = VGIO_COMMAND_UNKNOWN;
-	
-		/*获取数据*/
-		if(read(c_sock, &vc, sizeof(vc)) < 0){
-			perror("read data failed ");
+		/*获取数据, 一次读取可能包含多条命令, 最后一条可能不完整*/
+		ssize_t n = read(c_sock, buffer + length, sizeof(buffer) - length);
+		if(n <= 0){
+			if(n < 0){
+				perror("read data failed ");
+			}
 			break;
 		}
+		length += (uint32_t)n;
+
+		uint32_t pos = 0;
+		while(pos < length){
+			int r = vgio_decode(buffer + pos, length - pos, &vc);
+			if(r == 0){
+				break;
+			}
+			if(r < 0){
+				fprintf(stderr, "bad command %d\n", buffer[pos]);
+				length = pos = 0;
+				break;
+			}
+
+			command_proc(&vc);
+			pos += (uint32_t)r;
+		}
+
+		memmove(buffer, buffer + pos, length - pos);
+		length -= pos;
+	}
+
+	//先停止刷新线程, 避免与最后一帧同时使用g_vgio_render
+	__atomic_store_n(&g_vgio_stop, 1, __ATOMIC_RELEASE);
+	vgio_shm_commit(g_vgio_shm);
+	pthread_join(pid, NULL);
+
+	//vm退出后显示最后的画面
+	vgio_flush();
 
-		command_proc(c_sock, &vc);
-		//vgio_flush();
+	if(!g_vgio_private){
+		vgio_shm_remove();
 	}
 
-	pthread_cancel(pid);
 	close(fd);
 	return 0;
 }
@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -22,6 +25,195 @@ struct vgui_screen {
 	int bgcolor;	//背景色
 } g_vgui_screen_info = {{0,0},0,0};
 
+//与vgio_cli共享的文本缓冲区
+struct vgio_shm* g_vgui_shm = NULL;
+
+/*
+ * 发往vgio_cli的命令先编码进环形缓冲区, 由刷新线程每帧用一次writev发出,
+ * 缓冲区满时立即发出, 连续的SET_CHAR先在span中合并为一段
+ */
+#define VGUI_RING_SIZE		4096	//2的幂
+#define VGUI_SPAN_CELLS		256
+#define VGUI_FRAME_US		20000	//每帧20ms
+
+struct vgui_conn{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;	//有待发送的命令时通知刷新线程
+	uint8_t ring[VGUI_RING_SIZE];
+	uint32_t head;			//下一个待发送的字节, 与tail一样只增不减
+	uint32_t tail;
+	uint32_t span_offset;	//合并中的SET_CHAR
+	uint32_t span_count;
+	uint8_t span[VGUI_SPAN_CELLS * 2];
+	uint64_t commands;
+	uint64_t writes;
+};
+
+static struct vgui_conn g_vgui_conn = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static inline int vgui_conn_pending(struct vgui_conn* conn){
+	return conn->head != conn->tail || conn->span_count != 0;
+}
+
+//发出环形缓冲区中的全部数据, 回绕时分两段
+static void vgui_ring_write(struct vgui_conn* conn){
+	while(conn->head != conn->tail){
+		uint32_t start = conn->head & (VGUI_RING_SIZE - 1);
+		uint32_t size = conn->tail - conn->head;
+		struct iovec iov[2];
+		int iovcnt = 1;
+
+		iov[0].iov_base = conn->ring + start;
+		iov[0].iov_len = size;
+		if(start + size > VGUI_RING_SIZE){
+			iov[0].iov_len = VGUI_RING_SIZE - start;
+			iov[1].iov_base = conn->ring;
+			iov[1].iov_len = size - iov[0].iov_len;
+			iovcnt = 2;
+		}
+
+		ssize_t n = writev(vgui_sock, iov, iovcnt);
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			//vgio_cli已退出, 丢弃输出
+			conn->head = conn->tail;
+			break;
+		}
+
+		conn->head += (uint32_t)n;
+		conn->writes++;
+	}
+}
+
+//把length字节加入环形缓冲区, 空间不足时先发出
+static void vgui_ring_put(struct vgui_conn* conn, const uint8_t* data, uint32_t length){
+	uint32_t start = 0;
+	uint32_t first = 0;
+
+	if(VGUI_RING_SIZE - (conn->tail - conn->head) < length){
+		vgui_ring_write(conn);
+	}
+
+	start = conn->tail & (VGUI_RING_SIZE - 1);
+	first = length < VGUI_RING_SIZE - start ? length : VGUI_RING_SIZE - start;
+
+	memcpy(conn->ring + start, data, first);
+	memcpy(conn->ring, data + first, length - first);
+	conn->tail += length;
+}
+
+//把合并中的SET_CHAR编码进环形缓冲区
+static void vgui_span_put(struct vgui_conn* conn){
+	struct vgio_command vc;
+	uint8_t header[VGIO_COMMAND_MAX];
+
+	if(conn->span_count == 0){
+		return;
+	}
+
+	vc.command = VGIO_COMMAND_SET_CHAR;
+	vc.span.offset = conn->span_offset;
+	vc.span.count = conn->span_count;
+
+	vgui_ring_put(conn, header, vgio_encode(header, &vc));
+	vgui_ring_put(conn, conn->span, conn->span_count * 2);
+	conn->span_count = 0;
+	conn->commands++;
+}
+
+static void vgui_conn_flush(struct vgui_conn* conn){
+	vgui_span_put(conn);
+	vgui_ring_write(conn);
+}
+
+//命令加入当前帧
+static void vgui_command(struct vgio_command* vc){
+	struct vgui_conn* conn = &g_vgui_conn;
+	uint8_t buffer[VGIO_COMMAND_MAX];
+
+	if(vgui_sock < 0){
+		return;
+	}
+
+	pthread_mutex_lock(&conn->mutex);
+
+	if(!vgui_conn_pending(conn)){
+		pthread_cond_signal(&conn->cond);
+	}
+
+	//保持命令的顺序
+	vgui_span_put(conn);
+	vgui_ring_put(conn, buffer, vgio_encode(buffer, vc));
+	conn->commands++;
+
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+//第cell个字符加入当前帧, 与前一个字符相邻时合并
+static void vgui_command_cell(uint32_t cell, uint8_t c, uint8_t attr){
+	struct vgui_conn* conn = &g_vgui_conn;
+
+	if(vgui_sock < 0){
+		return;
+	}
+
+	pthread_mutex_lock(&conn->mutex);
+
+	if(!vgui_conn_pending(conn)){
+		pthread_cond_signal(&conn->cond);
+	}
+
+	if(conn->span_count != 0 &&
+			(cell != conn->span_offset + conn->span_count || conn->span_count == VGUI_SPAN_CELLS)){
+		vgui_span_put(conn);
+	}
+
+	if(conn->span_count == 0){
+		conn->span_offset = cell;
+	}
+
+	conn->span[conn->span_count * 2] = c;
+	conn->span[conn->span_count * 2 + 1] = attr;
+	conn->span_count++;
+
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+//每帧发出一次, 没有命令时不唤醒
+static void* vgui_task_flush(void* arg){
+	struct vgui_conn* conn = &g_vgui_conn;
+	(void)arg;
+
+	pthread_mutex_lock(&conn->mutex);
+
+	while(1){
+		while(!vgui_conn_pending(conn)){
+			pthread_cond_wait(&conn->cond, &conn->mutex);
+		}
+
+		//等待一帧, 合并这段时间内的命令
+		pthread_mutex_unlock(&conn->mutex);
+		usleep(VGUI_FRAME_US);
+		pthread_mutex_lock(&conn->mutex);
+
+		vgui_conn_flush(conn);
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+
+	return NULL;
+}
+
+//通知vgio_cli共享内存已修改, vgio_cli等待时才需要系统调用
+static inline void vgui_shm_commit(void){
+	vgio_shm_commit(g_vgui_shm);
+}
+
 //打印彩色信息
 void print_color(addr_t addr, uint32_t size){
 	//XXX
@@ -36,7 +228,33 @@ void print_bw(addr_t addr, uint32_t size){
 void print_text(addr_t addr, uint32_t size){
 }
 
+//同步光标位置到共享内存
+static void vgui_shm_cursor(void){
+	if(g_vgui_shm == NULL){
+		return;
+	}
+
+	g_vgui_shm->cursor_x = g_vgui_screen_info.cursor.x;
+	g_vgui_shm->cursor_y = g_vgui_screen_info.cursor.y;
+	vgui_shm_commit();
+}
+
 int vgui_init(void){
+	pthread_t tid;
+
+	//无法使用共享内存时, 文本通过socket以SET_CHAR发送
+	g_vgui_shm = vgio_shm_attach();
+	if(g_vgui_shm == NULL){
+		vm_fprintf(stderr, "attach screen shm failed, fall back to socket\n");
+	} else {
+		//共享内存可能留有上次运行的内容, 以guest当前的文本缓冲区为准
+		vm_read(0xb8000, g_vgui_shm->text, VGIO_TEXT_SIZE);
+		g_vgui_shm->cursor_x = 0;
+		g_vgui_shm->cursor_y = 0;
+		g_vgui_shm->page = 0;
+		vgui_shm_commit();
+	}
+
 	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if(fd < 0){
 		vm_fprintf(stderr, "create socket error\n");
@@ -56,27 +274,52 @@ int vgui_init(void){
 
 	vgui_sock = fd;
 
+	if(pthread_create(&tid, NULL, vgui_task_flush, NULL) != 0){
+		vm_fprintf(stderr, "create vgui flush task failed\n");
+		return 0;
+	}
+	pthread_detach(tid);
+
 	return 1;
 }
 
 int vgui_deinit(void){
+	pthread_mutex_lock(&g_vgui_conn.mutex);
+	vgui_conn_flush(&g_vgui_conn);
+	pthread_mutex_unlock(&g_vgui_conn.mutex);
+
 	close(vgui_sock);
 
+	if(g_vgui_shm != NULL){
+		vgio_shm_remove();
+		shmdt(g_vgui_shm);
+		g_vgui_shm = NULL;
+	}
+
 	return 0;
 }
 
+void vgui_stats(uint64_t* commands, uint64_t* writes){
+	pthread_mutex_lock(&g_vgui_conn.mutex);
+	*commands = g_vgui_conn.commands;
+	*writes = g_vgui_conn.writes;
+	pthread_mutex_unlock(&g_vgui_conn.mutex);
+}
+
 //设置光标位置
 void vgui_cursor_set(uint8_t x, uint8_t y){
 	//维护本地cursor
 	g_vgui_screen_info.cursor.x = x;
 	g_vgui_screen_info.cursor.y = y;
 
+	vgui_shm_cursor();
+
 	struct vgio_command vc;
 	vc.command = VGIO_COMMAND_SET_CURSOR;
 	vc.pixel.x = x;
 	vc.pixel.y = y;
 
-	write(vgui_sock, (void*)&vc, sizeof(struct vgio_command));
+	vgui_command(&vc);
 }
 
 //获取光标位置
@@ -91,11 +334,9 @@ void vgui_cursor_bkcolor(int color){
 
 	struct vgio_command vc;
 	vc.command = VGIO_COMMAND_SET_BG;
-	vc.pixel.x = g_vgui_screen_info.cursor.x;
-	vc.pixel.y = g_vgui_screen_info.cursor.y;
 	vc.pixel.bgcolor = color;
 
-	write(vgui_sock, (void*)&vc, sizeof(struct vgio_command));
+	vgui_command(&vc);
 }
 
 //设置前景色 30-37
@@ -104,37 +345,24 @@ void vgui_cursor_fgcolor(int color){
 
 	struct vgio_command vc;
 	vc.command = VGIO_COMMAND_SET_FG;
-	vc.pixel.x = g_vgui_screen_info.cursor.x;
-	vc.pixel.y = g_vgui_screen_info.cursor.y;
 	vc.pixel.fgcolor = color;
 
-	write(vgui_sock, (void*)&vc, sizeof(struct vgio_command));
+	vgui_command(&vc);
 }
 
-int8_t vgui_char(void){
-	struct vgio_command vc;
-	vc.command = VGIO_COMMAND_GET_CHAR;
-	vc.pixel.x = g_vgui_screen_info.cursor.x;
-	vc.pixel.y = g_vgui_screen_info.cursor.y;
-
-	write(vgui_sock, (void*)&vc, sizeof(struct vgio_command));
+//光标处的字符和属性直接从guest的文本缓冲区读取, 不需要vgio_cli参与
+uint16_t vgui_char(void){
+	uint32_t cell = (uint32_t)g_vgui_screen_info.cursor.y * VGIO_WIDTH + g_vgui_screen_info.cursor.x;
 
-	uint8_t c = 0;
-
-	read(vgui_sock, (void*)&c, 1);
+	if(cell * 2 + 1 >= VGIO_TEXT_SIZE){
+		return 0;
+	}
 
-	return c;
+	return vm_read_word(0xb8000 + cell * 2);
 }
 
-void vgui_set_char(uint8_t c){
-	struct vgio_command vc;
-	vc.command = VGIO_COMMAND_SET_CHAR;
-	vc.pixel.x = g_vgui_screen_info.cursor.x;
-	vc.pixel.y = g_vgui_screen_info.cursor.y;
-	vc.pixel.fgcolor = g_vgui_screen_info.fgcolor;
-	vc.pixel.bgcolor = g_vgui_screen_info.bgcolor;
-	vc.pixel.c = c;
-
+//光标移到下一个字符
+static void vgui_cursor_next(void){
 	if(g_vgui_screen_info.cursor.x + 1 < VGIO_WIDTH){
 		g_vgui_screen_info.cursor.x++;
 	} else {
@@ -142,5 +370,53 @@ void vgui_set_char(uint8_t c){
 		g_vgui_screen_info.cursor.x = 0;
 	}
 
-	write(vgui_sock, (void*)&vc, sizeof(struct vgio_command));
+	vgui_shm_cursor();
+}
+
+//写入guest的文本缓冲区, 由内存写入同步到共享内存
+void vgui_set_char(uint8_t c, uint8_t attr){
+	uint32_t cell = (uint32_t)g_vgui_screen_info.cursor.y * VGIO_WIDTH + g_vgui_screen_info.cursor.x;
+
+	if(cell * 2 + 1 < VGIO_TEXT_SIZE){
+		vm_write_word(0xb8000 + cell * 2, (uint16_t)(((uint16_t)attr << 8) | c));
+	}
+
+	vgui_cursor_next();
+}
+
+//只写字符字节, 属性字节不变
+void vgui_set_char_only(uint8_t c){
+	uint32_t cell = (uint32_t)g_vgui_screen_info.cursor.y * VGIO_WIDTH + g_vgui_screen_info.cursor.x;
+
+	if(cell * 2 < VGIO_TEXT_SIZE){
+		vm_write_byte(0xb8000 + cell * 2, c);
+	}
+
+	vgui_cursor_next();
+}
+
+void vgui_text_write(uint32_t offset, const uint8_t* data, uint32_t length){
+	uint32_t cell = 0;
+
+	if(offset >= VGIO_TEXT_SIZE || length == 0){
+		return;
+	}
+
+	if(length > VGIO_TEXT_SIZE - offset){
+		length = VGIO_TEXT_SIZE - offset;
+	}
+
+	if(g_vgui_shm != NULL){
+		memcpy(g_vgui_shm->text + offset, data, length);
+		vgui_shm_commit();
+		return;
+	}
+
+	//没有共享内存时按字符发送, 字符和属性都从guest内存中读取
+	for(cell = offset / 2; cell <= (offset + length - 1) / 2; cell++){
+		uint8_t pair[2];
+
+		vm_read(0xb8000 + cell * 2, pair, sizeof(pair));
+		vgui_command_cell(cell, pair[0], pair[1]);
+	}
 }
@@ -14,6 +14,8 @@ void print_text(addr_t addr, uint32_t size);
 
 int vgui_init(void);
 int vgui_deinit(void);
+//发往vgio_cli的命令数和实际的write次数
+void vgui_stats(uint64_t* commands, uint64_t* writes);
 
 //设置光标位置
 void vgui_cursor_set(uint8_t x, uint8_t y);
@@ -23,9 +25,13 @@ void vgui_cursor_get(uint8_t* x, uint8_t* y);
 void vgui_cursor_bkcolor(int color);
 //设置前景色 30-37
 void vgui_cursor_fgcolor(int color);
-//获取当前位置的字符
-int8_t vgui_char(void);
-//输出一个字符
-void vgui_set_char(uint8_t c);
+//获取当前位置的字符和属性, 高8位为属性
+uint16_t vgui_char(void);
+//输出一个字符, attr为字符属性
+void vgui_set_char(uint8_t c, uint8_t attr);
+//输出一个字符, 保留该位置原有的属性
+void vgui_set_char_only(uint8_t c);
+//文本缓冲区(0xb8000起)的[offset, offset + length)被写入, 同步到共享内存
+void vgui_text_write(uint32_t offset, const uint8_t* data, uint32_t length);
 
 #endif